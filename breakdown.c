@@ -0,0 +1,217 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/tick.h>
+#include <linux/seqlock.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/math64.h>
+
+#include "pacct.h"
+
+// Number of breakdown samples kept for the time series
+#define PACCT_BREAKDOWN_SAMPLES 128
+
+// Below this busy ratio (in percent of all online CPUs) the package power is
+// taken as idle power to learn idle_cpu_mW automatically.
+#define PACCT_IDLE_LEARN_BUSY_PCT 2
+
+// Idle power of one CPU in mW. If 0, it is learned from RAPL while the system
+// is idle.
+static unsigned int idle_cpu_mW;
+module_param(idle_cpu_mW, uint, 0644);
+
+// Spread the residual over the traced tasks in proportion to their energy
+static bool redistribute_residual;
+module_param(redistribute_residual, bool, 0644);
+
+DEFINE_PER_CPU(struct pacct_cpu_time, pacct_cpu_time);
+
+// Per-CPU values at the previous breakdown, to compute the interval deltas
+struct cpu_time_snapshot {
+	u64 user_ns;
+	u64 kthread_ns;
+	u64 idle_us;
+};
+
+static DEFINE_PER_CPU(struct cpu_time_snapshot, last_cpu_time);
+// Idle power of each CPU during the last interval in mW
+static DEFINE_PER_CPU(u32, cpu_idle_mW);
+
+static struct pacct_power_sample samples[PACCT_BREAKDOWN_SAMPLES];
+static unsigned int nr_samples; // total number of samples ever written
+static DEFINE_SEQLOCK(samples_lock);
+
+static u64 last_breakdown_ns;
+static u32 learned_idle_cpu_mW;
+static u32 residual_scale = PACCT_RESIDUAL_SCALE_ONE;
+
+static void snapshot_cpu_times(void)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		struct pacct_cpu_time *ct = per_cpu_ptr(&pacct_cpu_time, cpu);
+		struct cpu_time_snapshot *last =
+			per_cpu_ptr(&last_cpu_time, cpu);
+
+		last->user_ns = READ_ONCE(ct->user_ns);
+		last->kthread_ns = READ_ONCE(ct->kthread_ns);
+		last->idle_us = get_cpu_idle_time_us(cpu, NULL);
+	}
+}
+
+// Split the package power of the last interval into the power attributed to
+// the traced tasks, the power of kernel threads, the idle power and whatever
+// the model doesn't explain. Called from the gather work. Returns the power
+// the traced tasks should explain, or 0 if it isn't known yet.
+s64 pacct_update_power_breakdown(u64 attributed_mW, u64 pkg_mW)
+{
+	struct pacct_power_sample s = { 0 };
+	u64 now = ktime_get_ns();
+	u64 dt_ns = now - last_breakdown_ns;
+	u64 user_ns = 0, kthread_ns = 0, busy_ns = 0;
+	u32 idle_mW_per_cpu;
+	int cpu, nr_cpus = 0;
+
+	// The first call only takes the reference point. Without a package
+	// power (RAPL not readable yet) there is nothing to reconcile either.
+	if (!last_breakdown_ns || !pkg_mW || !dt_ns) {
+		snapshot_cpu_times();
+		last_breakdown_ns = now;
+		return 0;
+	}
+
+	idle_mW_per_cpu = READ_ONCE(idle_cpu_mW) ?: learned_idle_cpu_mW;
+
+	for_each_online_cpu(cpu) {
+		struct pacct_cpu_time *ct = per_cpu_ptr(&pacct_cpu_time, cpu);
+		struct cpu_time_snapshot *last =
+			per_cpu_ptr(&last_cpu_time, cpu);
+		u64 u = READ_ONCE(ct->user_ns);
+		u64 k = READ_ONCE(ct->kthread_ns);
+		u64 idle_us = get_cpu_idle_time_us(cpu, NULL);
+		u64 du = u - last->user_ns;
+		u64 dk = k - last->kthread_ns;
+		u64 didle_ns;
+
+		// Prefer the idle time of the tick code, it also covers the idle
+		// period the CPU is currently in. Without NO_HZ we fall back to
+		// the time not spent in any task since the last breakdown.
+		if (idle_us != (u64)-1 && last->idle_us != (u64)-1)
+			didle_ns = (idle_us - last->idle_us) * NSEC_PER_USEC;
+		else
+			didle_ns = dt_ns - min(dt_ns, du + dk);
+		didle_ns = min(didle_ns, dt_ns);
+
+		u32 cpu_mW = div64_u64((u64)idle_mW_per_cpu * didle_ns, dt_ns);
+		per_cpu(cpu_idle_mW, cpu) = cpu_mW;
+		s.idle_mW += cpu_mW;
+
+		user_ns += du;
+		kthread_ns += dk;
+		busy_ns += min(dt_ns, du + dk);
+
+		last->user_ns = u;
+		last->kthread_ns = k;
+		last->idle_us = idle_us;
+		nr_cpus++;
+	}
+	last_breakdown_ns = now;
+
+	// Learn the idle power of a CPU while the whole system is idle
+	if (nr_cpus && busy_ns * 100 <
+			       (u64)nr_cpus * dt_ns * PACCT_IDLE_LEARN_BUSY_PCT) {
+		u32 idle = div_u64(pkg_mW, nr_cpus);
+
+		learned_idle_cpu_mW = learned_idle_cpu_mW ?
+					      (learned_idle_cpu_mW * 7 + idle) >> 3 :
+					      idle;
+	}
+
+	// Kernel threads have no counters, so we charge them the average power
+	// the traced tasks draw per busy time.
+	if (user_ns)
+		s.kthread_mW = mul_u64_u64_div_u64(attributed_mW, kthread_ns,
+						   user_ns);
+
+	s.ts_ns = now;
+	s.pkg_mW = pkg_mW;
+	s.attributed_mW = attributed_mW;
+	s.residual_mW = (s64)pkg_mW - (s64)attributed_mW -
+			(s64)s.kthread_mW - (s64)s.idle_mW;
+
+	// The power the tasks should explain is the package power minus the idle
+	// and kernel thread power. Its ratio to the power of the model is used to
+	// scale the energy of the tasks, if enabled. The attributed power already
+	// contains the previous scale, so we undo it to get the model power.
+	s64 explained = (s64)pkg_mW - (s64)s.kthread_mW - (s64)s.idle_mW;
+	u64 model_mW = div64_u64(attributed_mW * PACCT_RESIDUAL_SCALE_ONE,
+				 residual_scale);
+	u32 scale = PACCT_RESIDUAL_SCALE_ONE;
+	if (READ_ONCE(redistribute_residual) && model_mW && explained > 0)
+		scale = clamp_t(u64,
+				div64_u64((u64)explained *
+						  PACCT_RESIDUAL_SCALE_ONE,
+					  model_mW),
+				PACCT_RESIDUAL_SCALE_ONE / 4,
+				PACCT_RESIDUAL_SCALE_ONE * 4);
+	WRITE_ONCE(residual_scale, scale);
+	s.residual_scale = scale;
+
+	write_seqlock(&samples_lock);
+	samples[nr_samples % PACCT_BREAKDOWN_SAMPLES] = s;
+	nr_samples++;
+	write_sequnlock(&samples_lock);
+
+	return explained;
+}
+
+// Scale (fixed point, PACCT_RESIDUAL_SCALE_ONE = 1.0) to apply to the energy
+// of the tasks so that the residual is redistributed over them
+u32 pacct_residual_scale(void)
+{
+	return READ_ONCE(residual_scale);
+}
+
+int pacct_breakdown_show(struct seq_file *m, void *v)
+{
+	struct pacct_power_sample *copy;
+	unsigned int n, first, seq;
+	int cpu;
+
+	copy = kmalloc_array(PACCT_BREAKDOWN_SAMPLES, sizeof(*copy),
+			     GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	do {
+		seq = read_seqbegin(&samples_lock);
+		n = min_t(unsigned int, nr_samples, PACCT_BREAKDOWN_SAMPLES);
+		first = nr_samples - n;
+		for (unsigned int i = 0; i < n; i++)
+			copy[i] = samples[(first + i) % PACCT_BREAKDOWN_SAMPLES];
+	} while (read_seqretry(&samples_lock, seq));
+
+	seq_puts(m,
+		 "ts_ms pkg_mW attributed_mW kthread_mW idle_mW residual_mW explained_pct scale\n");
+	for (unsigned int i = 0; i < n; i++) {
+		struct pacct_power_sample *s = &copy[i];
+
+		seq_printf(m, "%llu %llu %llu %llu %llu %lld %llu %u\n",
+			   s->ts_ns / NSEC_PER_MSEC, s->pkg_mW,
+			   s->attributed_mW, s->kthread_mW, s->idle_mW,
+			   s->residual_mW,
+			   div64_u64(s->attributed_mW * 100, s->pkg_mW),
+			   s->residual_scale);
+	}
+
+	seq_printf(m, "idle_cpu_mW %u\n",
+		   READ_ONCE(idle_cpu_mW) ?: learned_idle_cpu_mW);
+	for_each_online_cpu(cpu)
+		seq_printf(m, "cpu%d idle_mW %u\n", cpu, per_cpu(cpu_idle_mW, cpu));
+
+	kfree(copy);
+	return 0;
+}
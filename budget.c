@@ -0,0 +1,548 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/cgroup.h>
+#include <linux/mutex.h>
+#include <linux/pid.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <uapi/linux/sched.h>
+#include <uapi/linux/sched/types.h>
+
+#include "pacct.h"
+#include "pacct_trace.h"
+
+// Energy budgets. Rules are written to /proc/pacct_energy/budget, one per
+// line:
+//
+//   <pid|tgid|cgroup> <value> power <mW>
+//   <pid|tgid|cgroup> <value> energy <J> <window_ms>
+//
+// A power rule limits the sum of the power of the matching tasks, an energy
+// rule the energy they draw per window. A task is charged to the first rule
+// it matches, cgroup paths are on the default hierarchy and also match the
+// descendants. Each write replaces the whole rule set, an empty write or
+// "clear" removes all rules.
+//
+// The rules are checked by the estimator: every task it updates is added to
+// its rule, and at the end of the pass a rule over its limit is throttled, by
+// clamping the utilization of its tasks to budget_uclamp (uclamp_max, so
+// that schedutil runs them at a lower frequency). A power rule is released
+// once back under 90% of its limit, an energy rule when its window ends. The
+// clamps are applied to the tasks at their next estimation, and reset to the
+// system default on release. A process traced as a whole is clamped with all
+// its threads, and a task that inherits the clamp of a throttled parent gets
+// it reset at its first estimation unless its own rule is throttled.
+
+#define PACCT_BUDGET_MAX_RULES 64
+#define PACCT_BUDGET_MAX_WRITE PAGE_SIZE
+// The rules are resolved again this often, to follow cgroup migrations
+#define PACCT_BUDGET_RESOLVE_NS (1000 * NSEC_PER_MSEC)
+// Extra slots for the threads created while a process is being clamped
+#define PACCT_BUDGET_THREAD_SLACK 16
+
+// uclamp_max of the tasks of a throttled rule, out of SCHED_CAPACITY_SCALE
+static unsigned int budget_uclamp = 256;
+module_param(budget_uclamp, uint, 0644);
+
+enum pacct_budget_target {
+	PACCT_BUDGET_PID,
+	PACCT_BUDGET_TGID,
+	PACCT_BUDGET_CGROUP,
+};
+
+static const char *const target_names[] = {
+	[PACCT_BUDGET_PID] = "pid",
+	[PACCT_BUDGET_TGID] = "tgid",
+	[PACCT_BUDGET_CGROUP] = "cgroup",
+};
+
+enum pacct_budget_kind {
+	PACCT_BUDGET_POWER,
+	PACCT_BUDGET_ENERGY,
+};
+
+struct pacct_budget_rule {
+	enum pacct_budget_target target;
+	union {
+		pid_t pid;
+		struct cgroup *cgrp;
+	};
+	enum pacct_budget_kind kind;
+	u64 limit; // mW, or uJ per window
+	u64 window_ns;
+	char *arg; // as written, for reading the rules back
+
+	// Updated by the estimator
+	bool throttled;
+	u32 tasks; // charged to the rule in the last pass
+	u64 window_start_ns;
+	u64 window_uJ; // energy drawn in the current window
+	u64 pass_mW; // power of the tasks seen so far in the pass
+	u64 last_mW; // power of the tasks in the last pass
+
+	// Audit
+	u64 throttles;
+	u64 releases;
+	u64 overshoot_max; // mW or uJ above the limit
+	u64 throttled_ns; // total, up to the last release
+	u64 throttled_since_ns;
+};
+
+struct pacct_budget_set {
+	unsigned int nr_rules;
+	bool has_cgroup;
+	struct pacct_budget_rule rules[];
+};
+
+// Held by the estimator for a whole pass, and by the writers
+static DEFINE_MUTEX(budget_lock);
+static struct pacct_budget_set *budgets;
+// Entries resolved with another generation look up their rule again
+static u32 budget_gen = 1;
+static u64 budget_resolved_ns;
+static u32 pass_tasks[PACCT_BUDGET_MAX_RULES];
+
+static atomic64_t clamps_set = ATOMIC64_INIT(0);
+static atomic64_t clamps_reset = ATOMIC64_INIT(0);
+static atomic64_t clamps_failed = ATOMIC64_INIT(0);
+
+static void free_budgets(struct pacct_budget_set *b)
+{
+	if (!b)
+		return;
+
+	for (unsigned int i = 0; i < b->nr_rules; i++) {
+		if (b->rules[i].target == PACCT_BUDGET_CGROUP)
+			cgroup_put(b->rules[i].cgrp);
+		kfree(b->rules[i].arg);
+	}
+	kfree(b);
+}
+
+static int parse_rule(char *line, struct pacct_budget_rule *r)
+{
+	char *target = strsep(&line, " \t");
+	char *arg = strsep(&line, " \t");
+	char *kind = strsep(&line, " \t");
+	char *limit = strsep(&line, " \t");
+	char *window = line ? strim(line) : NULL;
+	u64 v, window_ms = 0;
+	int ret;
+
+	if (!target || !arg || !kind || !limit)
+		return -EINVAL;
+
+	ret = match_string(target_names, ARRAY_SIZE(target_names), target);
+	if (ret < 0)
+		return ret;
+	r->target = ret;
+
+	ret = kstrtou64(limit, 0, &v);
+	if (ret)
+		return ret;
+
+	if (!strcmp(kind, "power")) {
+		if (window && *window)
+			return -EINVAL;
+		r->kind = PACCT_BUDGET_POWER;
+		r->limit = v;
+	} else if (!strcmp(kind, "energy")) {
+		if (!window || kstrtou64(window, 0, &window_ms) || !window_ms)
+			return -EINVAL;
+		r->kind = PACCT_BUDGET_ENERGY;
+		r->limit = v * 1000000; // J to uJ
+		r->window_ns = window_ms * NSEC_PER_MSEC;
+	} else {
+		return -EINVAL;
+	}
+
+	switch (r->target) {
+	case PACCT_BUDGET_PID:
+	case PACCT_BUDGET_TGID:
+		ret = kstrtoint(arg, 0, &r->pid);
+		if (ret)
+			return ret;
+		break;
+	case PACCT_BUDGET_CGROUP:
+		r->cgrp = cgroup_get_from_path(arg);
+		if (IS_ERR(r->cgrp))
+			return PTR_ERR(r->cgrp);
+		break;
+	}
+
+	r->arg = kstrdup(arg, GFP_KERNEL);
+	if (!r->arg) {
+		if (r->target == PACCT_BUDGET_CGROUP)
+			cgroup_put(r->cgrp);
+		return -ENOMEM;
+	}
+	r->window_start_ns = ktime_get_ns();
+	return 0;
+}
+
+// Compile the written rules. Returns NULL for an empty rule set.
+static struct pacct_budget_set *compile_budgets(char *buf)
+{
+	struct pacct_budget_set *b;
+	char *line;
+	int ret;
+
+	b = kzalloc(struct_size(b, rules, PACCT_BUDGET_MAX_RULES), GFP_KERNEL);
+	if (!b)
+		return ERR_PTR(-ENOMEM);
+
+	while ((line = strsep(&buf, "\n")) != NULL) {
+		struct pacct_budget_rule *r;
+
+		line = strim(line);
+		if (!*line || *line == '#' || !strcmp(line, "clear"))
+			continue;
+		if (b->nr_rules == PACCT_BUDGET_MAX_RULES) {
+			ret = -E2BIG;
+			goto err;
+		}
+
+		r = &b->rules[b->nr_rules];
+		ret = parse_rule(line, r);
+		if (ret) {
+			pr_err("Invalid budget rule \"%s\": %d\n", line, ret);
+			goto err;
+		}
+		b->nr_rules++;
+		b->has_cgroup |= r->target == PACCT_BUDGET_CGROUP;
+	}
+
+	if (!b->nr_rules) {
+		kfree(b);
+		return NULL;
+	}
+	return b;
+
+err:
+	free_budgets(b);
+	return ERR_PTR(ret);
+}
+
+// Index of the first rule an entry matches, -1 for none
+static int budget_resolve(struct traced_task *e)
+{
+	struct cgroup *cgrp = NULL;
+	struct task_struct *t;
+	int found = -1;
+
+	rcu_read_lock();
+	if (budgets->has_cgroup) {
+		t = pid_task(find_vpid(e->pid), PIDTYPE_PID);
+		if (t)
+			cgrp = task_dfl_cgroup(t);
+	}
+
+	for (unsigned int i = 0; i < budgets->nr_rules && found < 0; i++) {
+		struct pacct_budget_rule *r = &budgets->rules[i];
+
+		switch (r->target) {
+		case PACCT_BUDGET_PID:
+			if (e->pid == r->pid)
+				found = i;
+			break;
+		case PACCT_BUDGET_TGID:
+			if (e->tgid == r->pid)
+				found = i;
+			break;
+		case PACCT_BUDGET_CGROUP:
+			if (cgrp && cgroup_is_descendant(cgrp, r->cgrp))
+				found = i;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return found;
+}
+
+// Set or reset the utilization clamp of the tasks of an entry: its thread, or
+// all the threads of the group for a process entry. sched_setattr_nocheck()
+// may sleep, so the threads are pinned under RCU and clamped afterwards.
+static void budget_clamp(struct traced_task *e, bool clamp)
+{
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		// Like sched_setattr() with SCHED_FLAG_KEEP_POLICY
+		.sched_policy = -1,
+		.sched_flags = SCHED_FLAG_KEEP_ALL | SCHED_FLAG_UTIL_CLAMP_MAX,
+		// -1 goes back to the system default
+		.sched_util_max = clamp ? min(READ_ONCE(budget_uclamp),
+					      (unsigned int)SCHED_CAPACITY_SCALE) :
+					  -1,
+	};
+	struct task_struct *leader = get_task_by_pid(e->pid);
+	struct task_struct **threads, *t;
+	unsigned int nr = 0, cap;
+	int ret = -ESRCH;
+
+	if (!leader)
+		goto out;
+
+	if (!e->per_process) {
+		ret = sched_setattr_nocheck(leader, &attr);
+		goto out_put;
+	}
+
+	cap = get_nr_threads(leader) + PACCT_BUDGET_THREAD_SLACK;
+	threads = kmalloc_array(cap, sizeof(*threads), GFP_KERNEL);
+	if (!threads) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+
+	rcu_read_lock();
+	for_each_thread(leader, t) {
+		if (nr == cap)
+			break;
+		get_task_struct(t);
+		threads[nr++] = t;
+	}
+	rcu_read_unlock();
+
+	ret = 0;
+	for (unsigned int i = 0; i < nr; i++) {
+		int err = sched_setattr_nocheck(threads[i], &attr);
+
+		if (err)
+			ret = err;
+		put_task_struct(threads[i]);
+	}
+	kfree(threads);
+
+out_put:
+	put_task_struct(leader);
+out:
+	// Not retried, the task may be gone or uclamp not built in
+	e->budget_clamped = clamp;
+	if (ret)
+		atomic64_inc(&clamps_failed);
+	else
+		atomic64_inc(clamp ? &clamps_set : &clamps_reset);
+}
+
+// A new task inherits the clamp of its parent. Its entry is marked clamped if
+// the parent's is, so that the estimator resets the clamp unless the rule of
+// the child is throttled too. Called from the fork hook under RCU.
+void pacct_budget_fork(struct traced_task *e, struct task_struct *parent)
+{
+	struct traced_task *p = pacct_find_traced_task(parent->pid);
+
+	// Threads of a process traced as a whole are clamped with the process
+	if (!p && parent->pid != parent->tgid) {
+		p = pacct_find_traced_task(parent->tgid);
+		if (p && !p->per_process)
+			p = NULL;
+	}
+	if (p && READ_ONCE(p->budget_clamped))
+		WRITE_ONCE(e->budget_clamped, true);
+}
+
+// Start of an estimator pass
+void pacct_budget_begin(void)
+{
+	u64 now = ktime_get_ns();
+
+	mutex_lock(&budget_lock);
+	if (budgets && now - budget_resolved_ns >= PACCT_BUDGET_RESOLVE_NS) {
+		budget_gen++;
+		budget_resolved_ns = now;
+	}
+	memset(pass_tasks, 0, sizeof(pass_tasks));
+}
+
+// Charge a task updated by the estimator to its rule, and bring its clamp in
+// line with the rule. O(1) but for the lookup of the rule, which is only done
+// again when the rules change and once per PACCT_BUDGET_RESOLVE_NS.
+void pacct_budget_account(struct traced_task *e, u64 delta_uJ)
+{
+	struct pacct_budget_rule *r = NULL;
+
+	if (!budgets && !e->budget_clamped)
+		return;
+
+	if (budgets) {
+		if (e->budget_gen != budget_gen) {
+			e->budget = budget_resolve(e);
+			e->budget_gen = budget_gen;
+		}
+		if (e->budget >= 0) {
+			r = &budgets->rules[e->budget];
+			r->window_uJ += delta_uJ;
+			r->pass_mW += atomic64_read(&e->power_w);
+			pass_tasks[e->budget]++;
+		}
+	}
+
+	if ((r && r->throttled) != e->budget_clamped)
+		budget_clamp(e, r && r->throttled);
+}
+
+static void budget_set_throttled(unsigned int i, struct pacct_budget_rule *r,
+				 bool throttled, u64 value, u64 now)
+{
+	r->throttled = throttled;
+	if (throttled) {
+		r->throttles++;
+		r->throttled_since_ns = now;
+	} else {
+		r->releases++;
+		r->throttled_ns += now - r->throttled_since_ns;
+	}
+	trace_pacct_budget(i, r->kind == PACCT_BUDGET_ENERGY, throttled, value,
+			   r->limit);
+}
+
+// End of an estimator pass: throttle the rules over their limit and release
+// the ones back under it
+void pacct_budget_end(void)
+{
+	u64 now = ktime_get_ns();
+
+	for (unsigned int i = 0; budgets && i < budgets->nr_rules; i++) {
+		struct pacct_budget_rule *r = &budgets->rules[i];
+		bool window_ended = false;
+		u64 value;
+
+		WRITE_ONCE(r->tasks, pass_tasks[i]);
+		if (r->kind == PACCT_BUDGET_POWER) {
+			value = r->pass_mW;
+			WRITE_ONCE(r->last_mW, value);
+			r->pass_mW = 0;
+		} else {
+			value = r->window_uJ;
+			if (now - r->window_start_ns >= r->window_ns) {
+				r->window_start_ns = now;
+				WRITE_ONCE(r->window_uJ, 0);
+				window_ended = true;
+			}
+		}
+
+		if (value > r->limit)
+			r->overshoot_max = max(r->overshoot_max,
+					       value - r->limit);
+
+		if (!r->throttled && value > r->limit && !window_ended)
+			budget_set_throttled(i, r, true, value, now);
+		else if (r->throttled &&
+			 (r->kind == PACCT_BUDGET_POWER ?
+				  value * 10 < r->limit * 9 :
+				  window_ended))
+			budget_set_throttled(i, r, false, value, now);
+	}
+	mutex_unlock(&budget_lock);
+}
+
+static ssize_t pacct_budget_write(struct file *file, const char __user *ubuf,
+				  size_t count, loff_t *ppos)
+{
+	struct pacct_budget_set *b, *old;
+	char *buf;
+
+	if (count > PACCT_BUDGET_MAX_WRITE)
+		return -E2BIG;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	b = compile_budgets(buf);
+	kfree(buf);
+	if (IS_ERR(b))
+		return PTR_ERR(b);
+
+	// The clamps of the tasks are brought in line with the new rules at
+	// their next estimation
+	mutex_lock(&budget_lock);
+	old = budgets;
+	budgets = b;
+	budget_gen++;
+	budget_resolved_ns = ktime_get_ns();
+	mutex_unlock(&budget_lock);
+
+	free_budgets(old);
+	return count;
+}
+
+static int pacct_budget_show(struct seq_file *m, void *v)
+{
+	u64 now = ktime_get_ns();
+
+	mutex_lock(&budget_lock);
+	for (unsigned int i = 0; budgets && i < budgets->nr_rules; i++) {
+		struct pacct_budget_rule *r = &budgets->rules[i];
+
+		if (r->kind == PACCT_BUDGET_POWER)
+			seq_printf(m, "%s %s power %llu\n",
+				   target_names[r->target], r->arg, r->limit);
+		else
+			seq_printf(m, "%s %s energy %llu %llu\n",
+				   target_names[r->target], r->arg,
+				   div_u64(r->limit, 1000000),
+				   div_u64(r->window_ns, NSEC_PER_MSEC));
+	}
+
+	seq_puts(m, "# rule kind tasks value limit throttled throttles releases overshoot_max throttled_ms\n");
+	for (unsigned int i = 0; budgets && i < budgets->nr_rules; i++) {
+		struct pacct_budget_rule *r = &budgets->rules[i];
+		u64 throttled_ns = r->throttled_ns;
+
+		if (r->throttled)
+			throttled_ns += now - r->throttled_since_ns;
+		seq_printf(m, "# %u %s %u %llu %llu %d %llu %llu %llu %llu\n", i,
+			   r->kind == PACCT_BUDGET_POWER ? "mW" : "uJ",
+			   r->tasks,
+			   r->kind == PACCT_BUDGET_POWER ? r->last_mW :
+							   r->window_uJ,
+			   r->limit, r->throttled, r->throttles, r->releases,
+			   r->overshoot_max,
+			   div_u64(throttled_ns, NSEC_PER_MSEC));
+	}
+	mutex_unlock(&budget_lock);
+
+	seq_printf(m, "# clamps_set %lld\n", atomic64_read(&clamps_set));
+	seq_printf(m, "# clamps_reset %lld\n", atomic64_read(&clamps_reset));
+	seq_printf(m, "# clamps_failed %lld\n", atomic64_read(&clamps_failed));
+	return 0;
+}
+
+static int pacct_budget_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pacct_budget_show, NULL);
+}
+
+const struct proc_ops pacct_budget_proc_ops = {
+	.proc_open = pacct_budget_open,
+	.proc_read = seq_read,
+	.proc_write = pacct_budget_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+// Give the task of a retired entry its utilization back. Called by the retire
+// work with the walk lock held: the entry may have been retired by the filter
+// or an exec while its task keeps running.
+void pacct_budget_retire(struct traced_task *e)
+{
+	if (e->budget_clamped)
+		budget_clamp(e, false);
+}
+
+// Drop the rules. Must be called once the estimator is stopped. The clamps
+// left are reset when the entries are drained, by the retire work.
+void pacct_budget_exit(void)
+{
+	mutex_lock(&budget_lock);
+	free_budgets(budgets);
+	budgets = NULL;
+	mutex_unlock(&budget_lock);
+}
@@ -0,0 +1,179 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/topology.h>
+#include <asm/cpufeature.h>
+#include <asm/processor.h>
+
+#include "pacct.h"
+
+// Where the energy is spent: per-CPU energy of the traced tasks, and its sums
+// by core type and by package.
+//
+// The switch hook charges the model energy of the counter deltas it records to
+// its CPU. Those are the raw counts, without the extrapolation of the rotated
+// events nor the residual scale, so every estimator pass splits the energy it
+// has charged to the tasks among the CPUs in proportion of what the hook
+// charged them since the previous pass, and the table adds up to the energy of
+// the traced tasks. The counters of process entries are only read by the
+// estimator, so the hook charges the slices of their threads at the average
+// power of the process instead.
+
+// Written by the hook of the CPU
+struct pacct_cpu_charge {
+	u64 model_uJ; // model energy of the recorded deltas
+	u64 runtime_ns; // runtime of the recorded deltas
+};
+
+// Written by the estimator
+struct pacct_cpu_energy {
+	u64 model_seen_uJ; // model_uJ at the last pass
+	u64 model_now_uJ; // model_uJ at this pass
+	u64 energy_uJ; // share of the task energy
+};
+
+static DEFINE_PER_CPU(struct pacct_cpu_charge, cpu_charge);
+static DEFINE_PER_CPU(struct pacct_cpu_energy, cpu_energy);
+
+// Called by the switch hook with the counter deltas of the task leaving the CPU
+void pacct_cpus_charge(const u64 *diffs, u64 runtime_ns)
+{
+	s64 acc = 0;
+
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++)
+		acc += diffs[i] * READ_ONCE(pacct_koeff[i]);
+
+	// Also called from the exit hook, with the interrupts on
+	if (acc > 0)
+		this_cpu_add(cpu_charge.model_uJ, acc);
+	this_cpu_add(cpu_charge.runtime_ns, runtime_ns);
+}
+
+// Called by the switch hook with the slice a thread of a process entry has run
+void pacct_cpus_charge_process(struct traced_task *e, u64 runtime_ns)
+{
+	// mW * ns = 10^-6 uJ
+	this_cpu_add(cpu_charge.model_uJ,
+		     div_u64(runtime_ns * atomic64_read(&e->power_a),
+			     NSEC_PER_MSEC));
+	this_cpu_add(cpu_charge.runtime_ns, runtime_ns);
+}
+
+// Split the energy charged to the tasks by an estimator pass among the CPUs
+void pacct_cpus_account(u64 delta_uJ)
+{
+	u64 total = 0;
+	int cpu;
+
+	// One snapshot of the charges for both loops, so that the hooks charging
+	// meanwhile can't make the shares add up to more than delta_uJ
+	for_each_possible_cpu(cpu) {
+		struct pacct_cpu_energy *c = per_cpu_ptr(&cpu_energy, cpu);
+
+		c->model_now_uJ = READ_ONCE(per_cpu(cpu_charge, cpu).model_uJ);
+		total += c->model_now_uJ - c->model_seen_uJ;
+	}
+	if (!total)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct pacct_cpu_energy *c = per_cpu_ptr(&cpu_energy, cpu);
+
+		WRITE_ONCE(c->energy_uJ,
+			   c->energy_uJ + mul_u64_u64_div_u64(
+						  delta_uJ,
+						  c->model_now_uJ -
+							  c->model_seen_uJ,
+						  total));
+		c->model_seen_uJ = c->model_now_uJ;
+	}
+}
+
+enum pacct_core_type {
+	PACCT_CORE_UNKNOWN,
+	PACCT_CORE_P,
+	PACCT_CORE_E,
+	PACCT_CORE_TYPES,
+};
+
+static const char *const core_type_names[] = {
+	[PACCT_CORE_UNKNOWN] = "-",
+	[PACCT_CORE_P] = "P",
+	[PACCT_CORE_E] = "E",
+};
+
+static enum pacct_core_type core_type(int cpu)
+{
+	if (!boot_cpu_has(X86_FEATURE_HYBRID_CPU))
+		return PACCT_CORE_UNKNOWN;
+
+	switch (cpu_data(cpu).topo.intel_type) {
+	case INTEL_CPU_TYPE_CORE:
+		return PACCT_CORE_P;
+	case INTEL_CPU_TYPE_ATOM:
+		return PACCT_CORE_E;
+	default:
+		return PACCT_CORE_UNKNOWN;
+	}
+}
+
+struct pacct_cpus_sum {
+	unsigned int cpus;
+	u64 energy_uJ;
+	u64 runtime_ns;
+};
+
+static void cpus_sum_add(struct pacct_cpus_sum *s, int cpu)
+{
+	s->cpus++;
+	s->energy_uJ += READ_ONCE(per_cpu(cpu_energy, cpu).energy_uJ);
+	s->runtime_ns += READ_ONCE(per_cpu(cpu_charge, cpu).runtime_ns);
+}
+
+static void cpus_sum_show(struct seq_file *m, const char *name,
+			  const struct pacct_cpus_sum *s)
+{
+	seq_printf(m, "%s %u %llu %llu\n", name, s->cpus, s->energy_uJ,
+		   div_u64(s->runtime_ns, NSEC_PER_MSEC));
+}
+
+int pacct_cpus_show(struct seq_file *m, void *v)
+{
+	struct pacct_cpus_sum types[PACCT_CORE_TYPES] = {};
+	int cpu;
+
+	seq_puts(m, "cpu pkg type energy_uJ runtime_ms\n");
+	for_each_possible_cpu(cpu) {
+		enum pacct_core_type type = core_type(cpu);
+
+		seq_printf(m, "%d %d %s %llu %llu\n", cpu,
+			   topology_physical_package_id(cpu),
+			   core_type_names[type],
+			   READ_ONCE(per_cpu(cpu_energy, cpu).energy_uJ),
+			   div_u64(READ_ONCE(per_cpu(cpu_charge, cpu).runtime_ns),
+				   NSEC_PER_MSEC));
+		cpus_sum_add(&types[type], cpu);
+	}
+
+	seq_puts(m, "type cpus energy_uJ runtime_ms\n");
+	for (int t = 0; t < PACCT_CORE_TYPES; t++)
+		if (types[t].cpus)
+			cpus_sum_show(m, core_type_names[t], &types[t]);
+
+	seq_puts(m, "pkg cpus energy_uJ runtime_ms\n");
+	for (unsigned int pkg = 0; pkg < topology_max_packages(); pkg++) {
+		struct pacct_cpus_sum s = {};
+		char name[12];
+
+		for_each_possible_cpu(cpu)
+			if (topology_physical_package_id(cpu) == pkg)
+				cpus_sum_add(&s, cpu);
+		if (!s.cpus)
+			continue;
+		snprintf(name, sizeof(name), "%u", pkg);
+		cpus_sum_show(m, name, &s);
+	}
+	return 0;
+}
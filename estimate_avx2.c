@@ -0,0 +1,30 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/types.h>
+
+#include "pacct.h"
+
+// Vector kernel of the estimator. This file is built with AVX2 enabled, see
+// the Makefile, so it must only be called between kernel_fpu_begin() and
+// kernel_fpu_end() on a CPU that has AVX2. It computes the same sums as
+// pacct_estimate_batch_scalar() in wq.c, four tasks at a time.
+
+typedef u64 pacct_v4u64 __attribute__((vector_size(32)));
+
+void pacct_estimate_batch_avx2(struct pacct_estimate_batch *b,
+			       const s64 *koeff)
+{
+	BUILD_BUG_ON(PACCT_ESTIMATE_BATCH % 4);
+
+	// The tail of the last vector reads stale slots, their sums are unused
+	for (unsigned int n = 0; n < b->nr; n += 4) {
+		pacct_v4u64 acc = { 0 };
+
+		// There is no 64 bit multiply in AVX2, the compiler builds it
+		// from 32 bit ones (vpmuludq)
+		for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++)
+			acc += *(const pacct_v4u64 *)&b->diff[i][n] *
+			       (u64)koeff[i];
+		*(pacct_v4u64 *)&b->energy[n] = acc;
+	}
+}
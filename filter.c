@@ -0,0 +1,380 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/cgroup.h>
+#include <linux/cred.h>
+#include <linux/glob.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/pid.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+#include "pacct.h"
+
+extern unsigned long *traced_pids;
+
+// Selective tracing. Rules are written to /proc/pacct_energy/filter, one per
+// line:
+//
+//   <include|exclude> <cgroup|uid|comm|pid|tgid> <value>
+//
+// A task is traced if it matches no exclude rule, and at least one include
+// rule if there are any. Without rules every user task is traced. cgroup
+// paths are on the default hierarchy and also match the descendants, comm
+// takes a glob pattern. Each write replaces the whole rule set, an empty write
+// or "clear" removes all rules.
+
+#define PACCT_FILTER_MAX_RULES 64
+#define PACCT_FILTER_MAX_WRITE PAGE_SIZE
+
+enum pacct_filter_type {
+	PACCT_FILTER_CGROUP,
+	PACCT_FILTER_UID,
+	PACCT_FILTER_COMM,
+	PACCT_FILTER_PID,
+	PACCT_FILTER_TGID,
+};
+
+static const char *const type_names[] = {
+	[PACCT_FILTER_CGROUP] = "cgroup", [PACCT_FILTER_UID] = "uid",
+	[PACCT_FILTER_COMM] = "comm",	  [PACCT_FILTER_PID] = "pid",
+	[PACCT_FILTER_TGID] = "tgid",
+};
+
+struct pacct_filter_rule {
+	bool exclude;
+	enum pacct_filter_type type;
+	union {
+		struct cgroup *cgrp;
+		kuid_t uid;
+		pid_t pid;
+		char comm[TASK_COMM_LEN];
+	};
+	char *arg; // as written, for reading the rules back
+};
+
+struct pacct_filter {
+	unsigned int nr_rules;
+	bool has_include;
+	bool has_comm;
+	struct pacct_filter_rule rules[];
+};
+
+static struct pacct_filter __rcu *active_filter;
+static DEFINE_MUTEX(filter_lock);
+
+// Per CPU, as the match is checked on every fork
+struct pacct_filter_stats {
+	u64 matched;
+	u64 rejected;
+};
+
+static DEFINE_PER_CPU(struct pacct_filter_stats, filter_stats);
+
+static bool rule_match(const struct pacct_filter_rule *r,
+		       struct task_struct *t)
+{
+	switch (r->type) {
+	case PACCT_FILTER_CGROUP:
+		return cgroup_is_descendant(task_dfl_cgroup(t), r->cgrp);
+	case PACCT_FILTER_UID:
+		return uid_eq(task_uid(t), r->uid);
+	case PACCT_FILTER_COMM:
+		return glob_match(r->comm, t->comm);
+	case PACCT_FILTER_PID:
+		return t->pid == r->pid;
+	case PACCT_FILTER_TGID:
+		return t->tgid == r->pid;
+	}
+	return false;
+}
+
+// Whether a task should be traced. Can be called from the trace hooks.
+bool pacct_filter_match(struct task_struct *t)
+{
+	struct pacct_filter *f;
+	bool included;
+
+	rcu_read_lock();
+	f = rcu_dereference(active_filter);
+	if (!f) {
+		rcu_read_unlock();
+		return true;
+	}
+
+	included = !f->has_include;
+	for (unsigned int i = 0; i < f->nr_rules; i++) {
+		const struct pacct_filter_rule *r = &f->rules[i];
+
+		if (!rule_match(r, t))
+			continue;
+		if (r->exclude) {
+			included = false;
+			break;
+		}
+		included = true;
+	}
+	rcu_read_unlock();
+
+	if (included)
+		this_cpu_inc(filter_stats.matched);
+	else
+		this_cpu_inc(filter_stats.rejected);
+	return included;
+}
+
+// Whether a task may start or stop matching when its comm changes on exec
+bool pacct_filter_has_comm(void)
+{
+	struct pacct_filter *f;
+	bool has_comm;
+
+	rcu_read_lock();
+	f = rcu_dereference(active_filter);
+	has_comm = f && f->has_comm;
+	rcu_read_unlock();
+
+	return has_comm;
+}
+
+static void free_filter(struct pacct_filter *f)
+{
+	if (!f)
+		return;
+
+	for (unsigned int i = 0; i < f->nr_rules; i++) {
+		if (f->rules[i].type == PACCT_FILTER_CGROUP)
+			cgroup_put(f->rules[i].cgrp);
+		kfree(f->rules[i].arg);
+	}
+	kfree(f);
+}
+
+static int parse_rule(char *line, struct pacct_filter_rule *r)
+{
+	char *action = strsep(&line, " \t");
+	char *type = strsep(&line, " \t");
+	char *arg = line ? strim(line) : NULL;
+	int ret;
+	u32 v;
+
+	if (!action || !type || !arg || !*arg)
+		return -EINVAL;
+
+	if (!strcmp(action, "include"))
+		r->exclude = false;
+	else if (!strcmp(action, "exclude"))
+		r->exclude = true;
+	else
+		return -EINVAL;
+
+	ret = match_string(type_names, ARRAY_SIZE(type_names), type);
+	if (ret < 0)
+		return ret;
+	r->type = ret;
+
+	switch (r->type) {
+	case PACCT_FILTER_CGROUP:
+		r->cgrp = cgroup_get_from_path(arg);
+		if (IS_ERR(r->cgrp))
+			return PTR_ERR(r->cgrp);
+		break;
+	case PACCT_FILTER_UID:
+		ret = kstrtou32(arg, 0, &v);
+		if (ret)
+			return ret;
+		r->uid = make_kuid(current_user_ns(), v);
+		if (!uid_valid(r->uid))
+			return -EINVAL;
+		break;
+	case PACCT_FILTER_COMM:
+		if (strscpy(r->comm, arg, TASK_COMM_LEN) < 0)
+			return -E2BIG;
+		break;
+	case PACCT_FILTER_PID:
+	case PACCT_FILTER_TGID:
+		ret = kstrtoint(arg, 0, &r->pid);
+		if (ret)
+			return ret;
+		break;
+	}
+
+	r->arg = kstrdup(arg, GFP_KERNEL);
+	if (!r->arg) {
+		if (r->type == PACCT_FILTER_CGROUP)
+			cgroup_put(r->cgrp);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+// Compile the written rules. Returns NULL for an empty rule set.
+static struct pacct_filter *compile_filter(char *buf)
+{
+	struct pacct_filter *f;
+	char *line;
+	int ret;
+
+	f = kzalloc(struct_size(f, rules, PACCT_FILTER_MAX_RULES), GFP_KERNEL);
+	if (!f)
+		return ERR_PTR(-ENOMEM);
+
+	while ((line = strsep(&buf, "\n")) != NULL) {
+		struct pacct_filter_rule *r;
+
+		line = strim(line);
+		if (!*line || *line == '#' || !strcmp(line, "clear"))
+			continue;
+		if (f->nr_rules == PACCT_FILTER_MAX_RULES) {
+			ret = -E2BIG;
+			goto err;
+		}
+
+		r = &f->rules[f->nr_rules];
+		ret = parse_rule(line, r);
+		if (ret) {
+			pr_err("Invalid filter rule \"%s\": %d\n", line, ret);
+			goto err;
+		}
+		f->nr_rules++;
+		f->has_include |= !r->exclude;
+		f->has_comm |= r->type == PACCT_FILTER_COMM;
+	}
+
+	if (!f->nr_rules) {
+		kfree(f);
+		return NULL;
+	}
+	return f;
+
+err:
+	free_filter(f);
+	return ERR_PTR(ret);
+}
+
+// Bring the traced tasks in line with the filter: retire the entries whose
+// task doesn't match anymore, and attach the processes that started to match
+// by the same rule as the scan at load. Apart from the snapshot of the
+// processes, the RCU read lock is only held for one task at a time.
+static void apply_filter(void)
+{
+	struct pacct_scan_slot *slots;
+	bool attached = false;
+	unsigned long pid;
+	int nr;
+
+	for_each_set_bit(pid, traced_pids, PID_MAX_LIMIT) {
+		struct task_struct *t;
+		struct traced_task *e;
+
+		rcu_read_lock();
+		t = pid_task(find_vpid(pid), PIDTYPE_PID);
+		e = pacct_find_traced_task(pid);
+		// Entries that outlive their task are left to the exit hook
+		if (t && e && !pacct_filter_match(t)) {
+			WRITE_ONCE(e->retiring, true);
+			pacct_retire_traced_task(e);
+		}
+		rcu_read_unlock();
+		cond_resched();
+	}
+
+	nr = pacct_scan_snapshot(&slots);
+	if (nr < 0) {
+		pr_err("Failed to allocate the task snapshot\n");
+		return;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		struct traced_task *e;
+
+		rcu_read_lock();
+		e = get_or_create_traced_task(slots[i].pid, slots[i].pid,
+					      slots[i].comm, true);
+		if (e)
+			attached |= READ_ONCE(e->needs_setup);
+		rcu_read_unlock();
+		cond_resched();
+	}
+	kvfree(slots);
+
+	if (attached)
+		queue_pacct_setup_work();
+}
+
+static ssize_t pacct_filter_write(struct file *file, const char __user *ubuf,
+				  size_t count, loff_t *ppos)
+{
+	struct pacct_filter *f, *old;
+	char *buf;
+
+	if (count > PACCT_FILTER_MAX_WRITE)
+		return -E2BIG;
+
+	buf = memdup_user_nul(ubuf, count);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	f = compile_filter(buf);
+	kfree(buf);
+	if (IS_ERR(f))
+		return PTR_ERR(f);
+
+	mutex_lock(&filter_lock);
+	old = rcu_replace_pointer(active_filter, f,
+				  lockdep_is_held(&filter_lock));
+	apply_filter();
+	mutex_unlock(&filter_lock);
+
+	synchronize_rcu();
+	free_filter(old);
+
+	return count;
+}
+
+static int pacct_filter_show(struct seq_file *m, void *v)
+{
+	struct pacct_filter *f;
+	u64 matched = 0, rejected = 0;
+	int cpu;
+
+	mutex_lock(&filter_lock);
+	f = rcu_dereference_protected(active_filter,
+				      lockdep_is_held(&filter_lock));
+	for (unsigned int i = 0; f && i < f->nr_rules; i++)
+		seq_printf(m, "%s %s %s\n",
+			   f->rules[i].exclude ? "exclude" : "include",
+			   type_names[f->rules[i].type], f->rules[i].arg);
+	mutex_unlock(&filter_lock);
+
+	for_each_possible_cpu(cpu) {
+		matched += per_cpu(filter_stats.matched, cpu);
+		rejected += per_cpu(filter_stats.rejected, cpu);
+	}
+	seq_printf(m, "# matched %llu\n", matched);
+	seq_printf(m, "# rejected %llu\n", rejected);
+	return 0;
+}
+
+static int pacct_filter_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pacct_filter_show, NULL);
+}
+
+const struct proc_ops pacct_filter_proc_ops = {
+	.proc_open = pacct_filter_open,
+	.proc_read = seq_read,
+	.proc_write = pacct_filter_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+// Drop the rules at module exit, once no hook can look at them anymore
+void pacct_filter_exit(void)
+{
+	free_filter(rcu_replace_pointer(active_filter, NULL, true));
+}
@@ -0,0 +1,174 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/seqlock.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/rculist.h>
+#include <linux/math64.h>
+
+#include "pacct.h"
+
+// Upper bound of history_samples, caps the memory of one task's history
+#define PACCT_HISTORY_MAX_SAMPLES 4096
+
+// Number of samples kept per task, 0 disables the history
+static unsigned int history_samples;
+module_param(history_samples, uint, 0444);
+
+// Minimal time covered by one sample. Estimator passes are merged until a
+// sample spans at least this long.
+static unsigned int history_period_ms = 1000;
+module_param(history_period_ms, uint, 0644);
+
+// Only tasks whose instant power reaches this get a history
+static unsigned int history_min_power_mW = 100;
+module_param(history_min_power_mW, uint, 0644);
+
+extern struct list_head traced_tasks;
+
+struct pacct_history_sample {
+	u64 ts_ns; // end of the sample
+	u64 energy_uJ;
+	u64 runtime_ns;
+};
+
+// Ring of samples of one task. Only the estimator writes to it.
+struct pacct_history {
+	seqcount_t seq;
+	unsigned int nr; // total number of samples ever written
+	u64 start_ns; // start of the sample being accumulated
+	u64 energy_uJ; // accumulated for the current sample
+	u64 runtime_ns;
+	struct pacct_history_sample samples[];
+};
+
+static atomic_t history_tasks = ATOMIC_INIT(0);
+static atomic_t history_alloc_failed = ATOMIC_INIT(0);
+
+static unsigned int history_len(void)
+{
+	return min(history_samples, PACCT_HISTORY_MAX_SAMPLES);
+}
+
+// Add an estimator pass to the history of a task. The history is allocated
+// the first time the task draws at least history_min_power_mW.
+void pacct_history_record(struct traced_task *e, u64 energy_uJ, u64 runtime_ns)
+{
+	struct pacct_history *h = e->history;
+	unsigned int len = history_len();
+	u64 now;
+
+	if (!len)
+		return;
+
+	now = ktime_get_ns();
+	if (!h) {
+		if (atomic64_read(&e->power_i) < READ_ONCE(history_min_power_mW))
+			return;
+
+		h = kzalloc(struct_size(h, samples, len),
+			    GFP_KERNEL | __GFP_NOWARN);
+		if (!h) {
+			atomic_inc(&history_alloc_failed);
+			return;
+		}
+		seqcount_init(&h->seq);
+		h->start_ns = now;
+		atomic_inc(&history_tasks);
+		WRITE_ONCE(e->history, h);
+	}
+
+	h->energy_uJ += energy_uJ;
+	h->runtime_ns += runtime_ns;
+	if (now - h->start_ns < (u64)READ_ONCE(history_period_ms) * NSEC_PER_MSEC)
+		return;
+
+	write_seqcount_begin(&h->seq);
+	h->samples[h->nr % len] = (struct pacct_history_sample){
+		.ts_ns = now,
+		.energy_uJ = h->energy_uJ,
+		.runtime_ns = h->runtime_ns,
+	};
+	h->nr++;
+	write_seqcount_end(&h->seq);
+
+	h->start_ns = now;
+	h->energy_uJ = 0;
+	h->runtime_ns = 0;
+}
+
+void pacct_history_free(struct traced_task *e)
+{
+	if (!e->history)
+		return;
+
+	kfree(e->history);
+	e->history = NULL;
+	atomic_dec(&history_tasks);
+}
+
+static void show_task_history(struct seq_file *m, struct traced_task *e,
+			      struct pacct_history_sample *copy)
+{
+	struct pacct_history *h = READ_ONCE(e->history);
+	unsigned int len = history_len();
+	unsigned int n, first, seq;
+
+	do {
+		seq = read_seqcount_begin(&h->seq);
+		n = min(h->nr, len);
+		first = h->nr - n;
+		for (unsigned int i = 0; i < n; i++)
+			copy[i] = h->samples[(first + i) % len];
+	} while (read_seqcount_retry(&h->seq, seq));
+
+	for (unsigned int i = 0; i < n; i++)
+		seq_printf(m, "%d %llu %llu %llu\n", e->pid,
+			   copy[i].ts_ns / NSEC_PER_MSEC, copy[i].energy_uJ,
+			   copy[i].runtime_ns / NSEC_PER_USEC);
+}
+
+// All histories at once, one sample per line. The list is walked under RCU,
+// so a long read doesn't hold off the trace hooks. The histories are freed
+// with their entries, after a grace period.
+static int pacct_history_show(struct seq_file *m, void *v)
+{
+	struct pacct_history_sample *copy;
+	struct traced_task *e;
+
+	seq_printf(m, "# tasks %d alloc_failed %d\n",
+		   atomic_read(&history_tasks),
+		   atomic_read(&history_alloc_failed));
+	seq_puts(m, "pid ts_ms energy_uJ runtime_us\n");
+
+	if (!atomic_read(&history_tasks) || !history_len())
+		return 0;
+
+	copy = kvmalloc_array(history_len(), sizeof(*copy), GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(e, &traced_tasks, list) {
+		if (READ_ONCE(e->history))
+			show_task_history(m, e, copy);
+	}
+	rcu_read_unlock();
+
+	kvfree(copy);
+	return 0;
+}
+
+static int pacct_history_open(struct inode *inode, struct file *file)
+{
+	// The output grows with the number of tasks, start with a large buffer
+	return single_open_size(file, pacct_history_show, NULL,
+				PAGE_SIZE * 16);
+}
+
+const struct proc_ops pacct_history_proc_ops = {
+	.proc_open = pacct_history_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
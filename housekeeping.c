@@ -0,0 +1,151 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/cpumask.h>
+#include <linux/sched/isolation.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
+#include <linux/workqueue.h>
+
+#include "pacct.h"
+
+// Housekeeping CPUs. All the background works of the module run on a
+// workqueue of its own, queued on the CPUs of a mask, and the RAPL MSR is
+// read on one of them, so that the isolated CPUs (nohz_full, isolcpus) are
+// never disturbed by the module. The hooks themselves still run where the
+// traced tasks run, but the timers of the sampling mode only run on the CPUs
+// of the mask.
+
+// CPUs for the works and the MSR reads, e.g. "0-3". By default the
+// housekeeping CPUs of the workqueues and of the scheduler domains.
+static char *cpulist;
+module_param(cpulist, charp, 0444);
+
+struct workqueue_struct *pacct_wq;
+static cpumask_var_t hk_mask;
+
+static const char *const work_names[] = {
+	[PACCT_WORK_SETUP] = "setup",
+	[PACCT_WORK_RETIRE] = "retire",
+	[PACCT_WORK_FREE] = "free",
+	[PACCT_WORK_SCAN] = "scan",
+	[PACCT_WORK_ESTIMATE] = "estimate",
+	[PACCT_WORK_GATHER] = "gather",
+	[PACCT_WORK_MSR] = "msr",
+};
+
+// Works that ran, or MSR reads that went, outside the mask. Happens when the
+// CPU a work was queued on goes offline, or when no CPU of the mask is online.
+static atomic64_t violations[PACCT_WORK_NR];
+
+int pacct_hk_init(void)
+{
+	int ret;
+
+	if (!zalloc_cpumask_var(&hk_mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	if (cpulist) {
+		ret = cpulist_parse(cpulist, hk_mask);
+		if (ret) {
+			pr_err("Invalid cpulist %s: %d\n", cpulist, ret);
+			goto err;
+		}
+	} else {
+		cpumask_and(hk_mask, housekeeping_cpumask(HK_TYPE_WQ),
+			    housekeeping_cpumask(HK_TYPE_DOMAIN));
+	}
+	if (!cpumask_intersects(hk_mask, cpu_online_mask)) {
+		pr_err("No online CPU in %*pbl\n", cpumask_pr_args(hk_mask));
+		ret = -EINVAL;
+		goto err;
+	}
+
+	// Bound, so that the CPU a work is queued on is where it runs
+	pacct_wq = alloc_workqueue(KBUILD_MODNAME, 0, 0);
+	if (!pacct_wq) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	pr_info("Background work on CPUs %*pbl\n", cpumask_pr_args(hk_mask));
+	return 0;
+
+err:
+	free_cpumask_var(hk_mask);
+	return ret;
+}
+
+// Must be called once nothing queues works anymore
+void pacct_hk_exit(void)
+{
+	if (!pacct_wq)
+		return;
+
+	destroy_workqueue(pacct_wq);
+	pacct_wq = NULL;
+	free_cpumask_var(hk_mask);
+}
+
+// Whether a CPU is one the works may run on
+bool pacct_hk_allowed(int cpu)
+{
+	return cpumask_test_cpu(cpu, hk_mask);
+}
+
+// Number of online CPUs the works may run on
+unsigned int pacct_hk_nr_cpus(void)
+{
+	return cpumask_weight_and(hk_mask, cpu_online_mask);
+}
+
+// CPU to queue a work on: the current one when allowed, otherwise the next
+// online CPU of the mask, so that the works of the isolated CPUs spread over
+// the housekeeping ones
+int pacct_hk_cpu(void)
+{
+	int cpu = raw_smp_processor_id();
+	unsigned int next;
+
+	if (pacct_hk_allowed(cpu))
+		return cpu;
+
+	next = cpumask_next_and(cpu, hk_mask, cpu_online_mask);
+	if (next >= nr_cpu_ids)
+		next = cpumask_first_and(hk_mask, cpu_online_mask);
+	return next < nr_cpu_ids ? next : WORK_CPU_UNBOUND;
+}
+
+// CPU to read the package MSRs of package 0 on. The current one when it is
+// allowed and in package 0, so that the read needs no IPI at all.
+int pacct_hk_msr_cpu(void)
+{
+	int cpu = raw_smp_processor_id();
+
+	if (pacct_hk_allowed(cpu) && topology_physical_package_id(cpu) == 0)
+		return cpu;
+
+	for_each_cpu_and(cpu, hk_mask, cpu_online_mask)
+		if (topology_physical_package_id(cpu) == 0)
+			return cpu;
+
+	atomic64_inc(&violations[PACCT_WORK_MSR]);
+	return 0;
+}
+
+// Called at the start of the works, counts those running outside the mask
+void pacct_hk_check(enum pacct_work w)
+{
+	if (unlikely(!pacct_hk_allowed(raw_smp_processor_id())))
+		atomic64_inc(&violations[w]);
+}
+
+int pacct_hk_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "cpus %*pbl\n", cpumask_pr_args(hk_mask));
+	seq_puts(m, "work violations\n");
+	for (int w = 0; w < PACCT_WORK_NR; w++)
+		seq_printf(m, "%s %lld\n", work_names[w],
+			   atomic64_read(&violations[w]));
+	return 0;
+}
@@ -5,10 +5,21 @@
 #include <linux/perf_event.h>
 #include <linux/tracepoint.h>
 #include <linux/smp.h>
+#include <linux/hashtable.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/clock.h>
+#include <linux/threads.h>
+#include <linux/binfmts.h>
+#include <linux/vmalloc.h>
 
 #include "pacct.h"
 #include "proc.h"
 
+// The module's own trace events are instantiated here
+#define CREATE_TRACE_POINTS
+#include "pacct_trace.h"
+
 MODULE_AUTHOR("pm3");
 MODULE_DESCRIPTION("Process Energy Accounting Module");
 MODULE_LICENSE("GPL");
@@ -18,13 +29,32 @@ MODULE_VERSION("0.1");
 static struct tracepoint *tp_sched_switch;
 static struct tracepoint *tp_sched_exit;
 static struct tracepoint *tp_sched_fork;
+static struct tracepoint *tp_sched_exec;
 
 // List of tasks being traced
 struct list_head traced_tasks;
+// Index of traced_tasks by PID. Both are changed under traced_tasks_lock and
+// walked under RCU.
+DEFINE_HASHTABLE(traced_tasks_hash, PACCT_HASH_BITS);
+// Bitmap of the PIDs in traced_tasks_hash, so that the hooks can skip the
+// untraced tasks without taking traced_tasks_lock. Bits are changed under the
+// lock along with the hash table.
+unsigned long *traced_pids;
+// Trace thread groups as a whole, see process.c
+extern bool per_process;
+// Sample the running tasks instead of hooking the switches, see sample.c
+extern unsigned int sample_hz;
 // List of tasks that are being retired (for cleanup)
 struct list_head retiring_traced_tasks;
 // Lock to protect access to the traced_tasks list
 spinlock_t traced_tasks_lock;
+// Held by the walks of traced_tasks that sleep, so that the entries they pass
+// are not freed under them. The free work takes it too.
+DEFINE_MUTEX(traced_tasks_walk_lock);
+// Counters for retired, pending and freed traced tasks
+struct pacct_reclaim_stats reclaim_stats;
+// Progress of the initial attach to the pre-existing processes
+struct pacct_scan_stats scan_stats;
 
 // Global variable to hold the total estimated power consumption across all traced tasks
 u64 total_power; // average power in mW (based on wall clock time)
@@ -32,9 +62,10 @@ u64 total_power; // average power in mW (based on wall clock time)
 // RAPL things
 u64 last_pkg_raw, last_ns;
 
+// Called under RCU, the hooks don't take a reference on the entry
 static struct traced_task *get_traced_task(pid_t pid)
 {
-	return get_or_create_traced_task(pid, NULL, false);
+	return pacct_find_traced_task(pid);
 }
 
 static __inline__ u64 u64_delta_sat(u64 now, u64 prev)
@@ -50,7 +81,7 @@ static __inline__ void init_traced_task(struct traced_task *e, u64 exec_runtime)
 	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
 		struct perf_event *ev = READ_ONCE(e->event[i]);
 		if (ev && !IS_ERR(ev))
-			WRITE_ONCE(e->counts[i], read_event_count(ev));
+			WRITE_ONCE(e->counts[i], read_event_count(ev, i));
 	}
 
 	// Also set the last timestamp to now to avoid having a large delta at the first estimation
@@ -59,8 +90,9 @@ static __inline__ void init_traced_task(struct traced_task *e, u64 exec_runtime)
 	return;
 }
 
-static void record_task_event_counts(struct traced_task *e,
-				     struct task_struct *ts)
+// Returns the runtime charged to the task
+static u64 record_task_event_counts(struct traced_task *e,
+				    struct task_struct *ts)
 {
 	atomic_inc(&e->record_count);
 
@@ -70,10 +102,11 @@ static void record_task_event_counts(struct traced_task *e,
 	if (last_exec_runtime == 0) {
 		// This can happen if the task is scheduled before we get a chance to initialize it
 		init_traced_task(e, exec_runtime);
-		return;
+		return 0;
 	}
 
 	u64 delta = u64_delta_sat(exec_runtime, last_exec_runtime);
+	u64 exec_delta = delta;
 	WRITE_ONCE(e->last_exec_runtime, exec_runtime);
 	atomic64_add(delta, &e->delta_exec_runtime_acc);
 
@@ -82,7 +115,7 @@ static void record_task_event_counts(struct traced_task *e,
 	if (unlikely(last_timestamp == 0)) {
 		// This can happen if the task is scheduled before we get a chance to initialize it
 		init_traced_task(e, exec_runtime);
-		return;
+		return 0;
 	}
 
 	delta = u64_delta_sat(now, last_timestamp);
@@ -91,35 +124,107 @@ static void record_task_event_counts(struct traced_task *e,
 
 	// For each event, read the current count, calculate the diff since last time,
 	// and accumulate the diff
+	u64 diffs[PACCT_TRACED_EVENT_COUNT] = { 0 };
 	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
 		struct perf_event *ev = READ_ONCE(e->event[i]);
 		if (ev && !IS_ERR(ev)) {
-			u64 val = read_event_count(ev); // new value
+			u64 val = read_event_count(ev, i); // new value
 			u64 diff = u64_delta_sat(val, READ_ONCE(e->counts[i]));
 
 			atomic64_add(diff, &e->diff_counts[i]);
 			WRITE_ONCE(e->counts[i], val);
+			diffs[i] = diff;
 		}
 	}
+
+	pacct_cpus_charge(diffs, exec_delta);
+	if (static_branch_unlikely(&pacct_recording))
+		pacct_record_switch(e, now, exec_delta, diffs);
+
+	if (unlikely(READ_ONCE(e->self)))
+		pacct_self_update(e);
+	return exec_delta;
 }
 
-static void pacct_sched_switch(void *ignore, bool preempt,
-			       struct task_struct *prev,
-			       struct task_struct *next)
+// Split the CPU time by the kind of task that has just run. Kernel threads
+// and idle are not traced, but are needed to reconcile the estimate with RAPL.
+static __inline__ void account_cpu_time(struct task_struct *prev)
+{
+	struct pacct_cpu_time *ct = this_cpu_ptr(&pacct_cpu_time);
+	u64 now = local_clock();
+	u64 last = ct->last_switch_ns;
+
+	ct->last_switch_ns = now;
+	if (unlikely(last == 0) || is_idle_task(prev))
+		return;
+
+	if (prev->flags & PF_KTHREAD)
+		WRITE_ONCE(ct->kthread_ns, ct->kthread_ns + (now - last));
+	else
+		WRITE_ONCE(ct->user_ns, ct->user_ns + (now - last));
+}
+
+static bool record_thread_runtime(struct task_struct *t, u64 *charged_ns)
 {
+	struct traced_task *e;
+	bool traced = false;
+
+	rcu_read_lock();
+	e = get_traced_task(t->tgid);
+	if (e && e->per_process && READ_ONCE(e->ready)) {
+		*charged_ns = pacct_record_process_runtime(e, t);
+		traced = true;
+	}
+	rcu_read_unlock();
+	return traced;
+}
+
+// Charge the time and the counters of a task leaving its CPU, or of the task
+// running at a sample in the sampling mode, see sample.c. Returns whether the
+// task is traced, and the runtime charged to it in charged_ns.
+bool pacct_account_task(struct task_struct *prev, u64 *charged_ns)
+{
+	bool traced = false;
+
+	*charged_ns = 0;
+	account_cpu_time(prev);
+
+	if (!test_bit(prev->pid, traced_pids)) {
+		// Threads of a process traced as a whole are charged to its entry
+		if (per_process && prev->pid != prev->tgid &&
+		    test_bit(prev->tgid, traced_pids))
+			return record_thread_runtime(prev, charged_ns);
+		return false;
+	}
+
+	rcu_read_lock();
 	struct traced_task *e = get_traced_task(prev->pid);
 	if (!e)
-		return;
+		goto out;
 
 	if (!READ_ONCE(e->ready)) {
 		WRITE_ONCE(e->needs_setup, true);
 		goto out;
 	}
 
-	record_task_event_counts(e, prev);
+	traced = true;
+	if (e->per_process)
+		*charged_ns = pacct_record_process_runtime(e, prev);
+	else
+		*charged_ns = record_task_event_counts(e, prev);
 
 out:
-	kref_put(&e->ref_count, release_traced_task);
+	rcu_read_unlock();
+	return traced;
+}
+
+static void pacct_sched_switch(void *ignore, bool preempt,
+			       struct task_struct *prev,
+			       struct task_struct *next)
+{
+	u64 charged_ns;
+
+	pacct_account_task(prev, &charged_ns);
 }
 
 static void pacct_process_fork(void *ignore, struct task_struct *parent,
@@ -129,8 +234,21 @@ static void pacct_process_fork(void *ignore, struct task_struct *parent,
 	if (child->flags & PF_KTHREAD)
 		return;
 
+	// Nor the tasks the filter rules out
+	if (!pacct_filter_match(child))
+		return;
+
+	// Threads of a process traced as a whole share its inherited counters
+	if (!pacct_task_has_entry(child))
+		return;
+
+	rcu_read_lock();
 	struct traced_task *e =
-		get_or_create_traced_task(child->pid, child->comm, true);
+		get_or_create_traced_task(child->pid, child->tgid, child->comm,
+					  true);
+	if (e)
+		pacct_budget_fork(e, parent);
+	rcu_read_unlock();
 	if (!e) {
 		pr_err("Failed to get or create traced task for PID %d\n",
 		       child->pid);
@@ -142,27 +260,70 @@ static void pacct_process_fork(void *ignore, struct task_struct *parent,
 
 	// schedule setup work for the new task to initialize its perf events
 	queue_pacct_setup_work();
+}
+
+// The comm changes on exec, which matters for the comm rules of the filter
+static void pacct_process_exec(void *ignore, struct task_struct *p,
+			       pid_t old_pid, struct linux_binprm *bprm)
+{
+	struct traced_task *e;
 
-	kref_put(&e->ref_count, release_traced_task);
+	if (!pacct_filter_has_comm())
+		return;
+
+	rcu_read_lock();
+	if (pacct_filter_match(p)) {
+		e = get_or_create_traced_task(p->pid, p->tgid, p->comm, true);
+		if (!e)
+			goto out;
+		strscpy(e->comm, p->comm, TASK_COMM_LEN);
+		if (READ_ONCE(e->needs_setup))
+			queue_pacct_setup_work();
+	} else {
+		if (!test_bit(p->pid, traced_pids))
+			goto out;
+		e = get_traced_task(p->pid);
+		if (!e)
+			goto out;
+		WRITE_ONCE(e->retiring, true);
+		pacct_retire_traced_task(e);
+	}
+out:
+	rcu_read_unlock();
 }
 
 static void pacct_process_exit(void *ignore, struct task_struct *p)
 {
-	struct traced_task *e = get_traced_task(p->pid);
+	pid_t pid = p->pid;
+
+	// A process entry outlives its leader until the last thread exits
+	if (!test_bit(pid, traced_pids)) {
+		if (!per_process || pid == p->tgid ||
+		    !test_bit(p->tgid, traced_pids))
+			return;
+		pid = p->tgid;
+	}
+
+	rcu_read_lock();
+	struct traced_task *e = get_traced_task(pid);
 	if (!e)
-		return;
+		goto out;
 
-	// Record final event counts for this exiting task before we clean it up.
-	record_task_event_counts(e, p);
+	if (e->per_process) {
+		pacct_record_process_runtime(e, p);
+		if (atomic_read(&p->signal->live))
+			goto out;
+	} else if (pid != p->pid) {
+		// The leader's own entry of a process with per-thread detail
+		goto out;
+	} else {
+		// Record final event counts for this exiting task before we clean it up.
+		record_task_event_counts(e, p);
+	}
 
 	// Mark this task as retiring so that the sample_workfn can skip it if it hasn't run yet
 	WRITE_ONCE(e->retiring, true);
 
-	// remove from traced_tasks
-	spin_lock(&traced_tasks_lock);
-	list_del_init(&e->list);
-	spin_unlock(&traced_tasks_lock);
-
 	// // print debug info about the exiting task
 	// pr_info("Process exiting: PID %d, COMM \"%s\", energy estimate %llu (uJ), power estimate %llu (mW), exec_runtime=%llu\n",
 	// 	e->pid, p->comm, atomic64_read(&e->energy),
@@ -180,11 +341,15 @@ static void pacct_process_exit(void *ignore, struct task_struct *p)
 	// 	}
 	// }
 
-	// add to retiring_traced_tasks for cleanup
-	list_add_tail(&e->retire_node, &retiring_traced_tasks);
+	// The retire work folds the last deltas, then emits the exit trace event
+	// and tells the netlink listeners
+	e->exit_ns = ktime_get_ns();
 
-	// we'd got a ref from get_traced_task()
-	kref_put(&e->ref_count, release_traced_task);
+	// remove from traced_tasks and add to retiring_traced_tasks for cleanup
+	pacct_retire_traced_task(e);
+
+out:
+	rcu_read_unlock();
 }
 
 //Looks for the wanted tracepoints and store in static variables
@@ -199,21 +364,11 @@ static void tp_lookup_cb(struct tracepoint *tp, void *priv)
 			tp_sched_exit = tp;
 		else if (!strcmp(name, "sched_process_fork"))
 			tp_sched_fork = tp;
+		else if (!strcmp(name, "sched_process_exec"))
+			tp_sched_exec = tp;
 	}
 }
 
-static void clean_traced_task(void)
-{
-	// Move all currently traced tasks to the retiring list for cleanup
-	struct traced_task *entry, *tmp;
-	spin_lock(&traced_tasks_lock);
-	list_for_each_entry_safe(entry, tmp, &traced_tasks, list) {
-		list_del_init(&entry->list);
-		list_add_tail(&entry->retire_node, &retiring_traced_tasks);
-	}
-	spin_unlock(&traced_tasks_lock);
-}
-
 static int __init pacct_energy_init(void) //Start of the module
 {
 	int ret;
@@ -224,8 +379,45 @@ static int __init pacct_energy_init(void) //Start of the module
 	spin_lock_init(&traced_tasks_lock);
 	INIT_LIST_HEAD(&traced_tasks);
 	INIT_LIST_HEAD(&retiring_traced_tasks);
+	hash_init(traced_tasks_hash);
+	atomic64_set(&reclaim_stats.retired, 0);
+	atomic_set(&reclaim_stats.pending, 0);
+	atomic64_set(&reclaim_stats.freed, 0);
+
+	// The works are queued on the housekeeping CPUs from the start
+	ret = pacct_hk_init();
+	if (ret)
+		goto err;
+
+	// Place the tracked events on the PMU before any counter is created
+	ret = pacct_pmu_init();
+	if (ret)
+		goto err;
+
+	ret = pacct_task_cache_init();
+	if (ret)
+		goto err;
+
+	traced_pids = vzalloc(BITS_TO_LONGS(PID_MAX_LIMIT) * sizeof(long));
+	if (!traced_pids) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	ret = pacct_netlink_init();
+	if (ret)
+		goto err;
+
+	ret = pacct_record_init();
+	if (ret)
+		goto err;
 
-	// Initialize the powercap interfaces and get the initial CPU frequency caps
+	ret = pacct_self_init();
+	if (ret)
+		goto err;
+
+	// Initialize the powercap interfaces and get the initial CPU frequency
+	// caps. Without cpufreq the module still loads and only accounts.
 	ret = powercap_init_caps();
 	if (ret) {
 		pr_err("powercap init failed: %d\n", ret);
@@ -254,14 +446,24 @@ static int __init pacct_energy_init(void) //Start of the module
 		goto err;
 	}
 
-	// Register the functions to be called on the trace points
-	ret = tracepoint_probe_register(tp_sched_switch,
-					(void *)pacct_sched_switch, NULL);
-	if (ret) {
-		pr_err("tracepoint_probe_register failed: %d\n", ret);
+	for_each_kernel_tracepoint(tp_lookup_cb, "sched_process_exec");
+	if (!tp_sched_exec) {
+		pr_err("tracepoint sched_process_exec not found\n");
+		ret = -ENOENT;
 		goto err;
 	}
 
+	// Register the functions to be called on the trace points. The sampling
+	// mode does without the switch hook.
+	if (!sample_hz) {
+		ret = tracepoint_probe_register(tp_sched_switch,
+						(void *)pacct_sched_switch, NULL);
+		if (ret) {
+			pr_err("tracepoint_probe_register failed: %d\n", ret);
+			goto err;
+		}
+	}
+
 	ret = tracepoint_probe_register(tp_sched_fork,
 					(void *)pacct_process_fork, NULL);
 	if (ret) {
@@ -276,16 +478,33 @@ static int __init pacct_energy_init(void) //Start of the module
 		goto err_tp_sched_fork;
 	}
 
+	ret = tracepoint_probe_register(tp_sched_exec,
+					(void *)pacct_process_exec, NULL);
+	if (ret) {
+		pr_err("tracepoint_probe_register for exec failed: %d\n", ret);
+		goto err_tp_sched_exit;
+	}
+
+	ret = pacct_sample_start();
+	if (ret)
+		goto err_tp_sched_exec;
+
 	init_proc(); // Create directory in proc/
 
+	// Start from the offline coefficients
+	pacct_model_init();
+
 	// Start the energy estimator work
 	pacct_start_energy_estimator();
 
-	// Schedule a delayed work to scan existing tasks and create traced_task entries for them
+	// Schedule a work to scan existing tasks and create traced_task entries for them
 	queue_pacct_scan_tasks();
 
 	return 0;
 
+err_tp_sched_exec:
+	tracepoint_probe_unregister(tp_sched_exec, (void *)pacct_process_exec,
+				    NULL);
 err_tp_sched_exit:
 	if (tp_sched_exit)
 		tracepoint_probe_unregister(tp_sched_exit,
@@ -295,12 +514,21 @@ err_tp_sched_fork:
 		tracepoint_probe_unregister(tp_sched_fork,
 					    (void *)pacct_process_fork, NULL);
 err_tp_sched_switch:
-	if (tp_sched_switch)
+	if (tp_sched_switch && !sample_hz)
 		tracepoint_probe_unregister(tp_sched_switch,
 					    (void *)pacct_sched_switch, NULL);
 	// Clean up any traced tasks that might have been created before the failure
-	clean_traced_task();
+	tracepoint_synchronize_unregister();
+	pacct_budget_exit();
+	pacct_drain_traced_tasks();
 err:
+	powercap_cleanup_caps();
+	pacct_self_exit();
+	pacct_record_exit();
+	pacct_netlink_exit();
+	vfree(traced_pids);
+	pacct_task_cache_exit();
+	pacct_hk_exit();
 	return ret;
 }
 
@@ -309,7 +537,8 @@ static void __exit pacct_energy_exit(void)
 	// Stop the energy estimator work by first
 	pacct_stop_energy_estimator();
 
-	if (tp_sched_switch)
+	pacct_sample_stop();
+	if (tp_sched_switch && !sample_hz)
 		tracepoint_probe_unregister(tp_sched_switch,
 					    (void *)pacct_sched_switch, NULL);
 
@@ -321,14 +550,36 @@ static void __exit pacct_energy_exit(void)
 		tracepoint_probe_unregister(tp_sched_exit,
 					    (void *)pacct_process_exit, NULL);
 
+	if (tp_sched_exec)
+		tracepoint_probe_unregister(tp_sched_exec,
+					    (void *)pacct_process_exec, NULL);
+
+	// Wait for in-flight hooks before we start tearing down the entries
+	tracepoint_synchronize_unregister();
+
 	// Clean up for powercap policies and interfaces
 	powercap_cleanup_caps();
 
-	// Clean up all traced tasks
-	clean_traced_task();
+	// No estimator pass is left to look at the budgets
+	pacct_budget_exit();
+
+	// Clean up all traced tasks, releasing their perf events and memory
+	pacct_drain_traced_tasks();
+	vfree(traced_pids);
+	pacct_task_cache_exit();
+
+	// Nothing queues exit records anymore
+	pacct_netlink_exit();
+	pacct_record_exit();
+	pacct_self_exit();
 
 	// Clean up proc entries for all traced tasks
 	remove_proc();
+	pacct_hk_exit();
+
+	// No hook nor writer is left to look at the filter rules
+	pacct_filter_exit();
+	pacct_per_thread_cleanup();
 
 	pr_info("pacct_energy removed\n");
 }
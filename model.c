@@ -0,0 +1,268 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/bitops.h>
+
+#include "pacct.h"
+
+extern atomic64_t pacct_negative_estimates;
+
+// Online recalibration of the model against RAPL.
+//
+// The offline coefficients of tracked_events[] are kept as they are, and we
+// fit a gain per event on top of them by recursive least squares (RLS) with
+// exponential forgetting:
+//
+//   y = sum_i gain_i * z_i
+//
+// where z_i is the energy event i contributed over a gather interval according
+// to its offline coefficient, and y is the package energy the traced tasks
+// should explain over the same interval (without idle and kernel threads).
+// Everything is done in fixed point with RLS_SHIFT fractional bits. z and y
+// of each sample are normalized by the same power of two, picked from the
+// magnitude of that sample, which doesn't change the gains. The magnitude
+// moves by orders between an idle and a loaded machine, and with the gather
+// period. A sample is only an outlier when it is far above the recent ones.
+
+#define RLS_N PACCT_TRACED_EVENT_COUNT
+#define RLS_SHIFT 20
+#define RLS_ONE (1LL << RLS_SHIFT)
+// Initial and maximal covariance diagonal. Limiting it avoids the wind-up of
+// the covariance when some events stay quiet for a long time.
+#define RLS_P_INIT RLS_ONE
+#define RLS_P_MAX (16 * RLS_ONE)
+// Bounds of the gains, so that a coefficient never flips its sign
+#define RLS_GAIN_MAX (4 * RLS_ONE)
+// Normalized values are about 0.5
+#define RLS_NORM_BITS (RLS_SHIFT - 1)
+// Samples more than 2^RLS_OUTLIER_BITS times the recent magnitude are
+// outliers. The recent magnitude follows the samples, outliers included, so
+// that a lasting change of the load is accepted after a few samples.
+#define RLS_OUTLIER_BITS 6
+// Fixed point one of the moving average of the shifts
+#define RLS_AVG_ONE 8
+
+static bool online_recalib;
+module_param(online_recalib, bool, 0644);
+
+// Forgetting factor of the RLS in ppm
+static unsigned int recalib_lambda_ppm = 995000;
+module_param(recalib_lambda_ppm, uint, 0644);
+
+// Maximal change of a gain per update in ppm
+static unsigned int recalib_max_step_ppm = 20000;
+module_param(recalib_max_step_ppm, uint, 0644);
+
+// Effective coefficients used by the estimator
+s64 pacct_koeff[PACCT_TRACED_EVENT_COUNT];
+
+// Per-event counter sums of all traced tasks since the last update
+static atomic64_t interval_sums[RLS_N];
+
+static DEFINE_MUTEX(model_lock);
+static s64 gain[RLS_N];
+static s64 P[RLS_N][RLS_N];
+// Moving average of the normalization shifts, in 1/RLS_AVG_ONE
+static int norm_shift_avg;
+static bool norm_ready;
+static u64 nr_outliers;
+static u64 last_update_ns;
+static u64 nr_updates;
+// Moving average of the a priori fit error in basis points of y
+static u64 fit_error_bp;
+
+void pacct_model_init(void)
+{
+	mutex_lock(&model_lock);
+	for (int i = 0; i < RLS_N; i++) {
+		WRITE_ONCE(pacct_koeff[i], tracked_events[i].koeff);
+		atomic64_set(&interval_sums[i], 0);
+		gain[i] = RLS_ONE;
+		for (int j = 0; j < RLS_N; j++)
+			P[i][j] = i == j ? RLS_P_INIT : 0;
+	}
+	norm_ready = false;
+	last_update_ns = 0;
+	nr_updates = 0;
+	nr_outliers = 0;
+	fit_error_bp = 0;
+	mutex_unlock(&model_lock);
+}
+
+// Add the per-event counter sums of one estimator pass
+void pacct_model_account(const u64 *sums)
+{
+	if (!READ_ONCE(online_recalib))
+		return;
+
+	for (int i = 0; i < RLS_N; i++)
+		if (sums[i])
+			atomic64_add(sums[i], &interval_sums[i]);
+}
+
+static s64 rls_norm(s64 v, int shift)
+{
+	return shift >= 0 ? v >> shift : v << -shift;
+}
+
+static s64 rls_clamp(__int128 v, s64 limit)
+{
+	if (v > limit)
+		return limit;
+	if (v < -limit)
+		return -limit;
+	return (s64)v;
+}
+
+// One RLS update with normalized features z and target y
+static s64 rls_step(const s64 *z, s64 y)
+{
+	s64 lambda = div_u64((u64)READ_ONCE(recalib_lambda_ppm) * RLS_ONE,
+			     1000000);
+	s64 max_step = div_u64((u64)READ_ONCE(recalib_max_step_ppm) * RLS_ONE,
+			       1000000);
+	s64 phi[RLS_N], k[RLS_N];
+	__int128 acc;
+	s64 denom, err, inv_lambda;
+
+	lambda = clamp_t(s64, lambda, RLS_ONE / 2, RLS_ONE);
+	inv_lambda = div64_s64(RLS_ONE * RLS_ONE, lambda);
+
+	// phi = P z
+	for (int i = 0; i < RLS_N; i++) {
+		acc = 0;
+		for (int j = 0; j < RLS_N; j++)
+			acc += (__int128)P[i][j] * z[j];
+		phi[i] = rls_clamp(acc >> RLS_SHIFT, S64_MAX >> (RLS_SHIFT + 2));
+	}
+
+	// denom = lambda + z' P z
+	acc = 0;
+	for (int i = 0; i < RLS_N; i++)
+		acc += (__int128)z[i] * phi[i];
+	denom = lambda + rls_clamp(acc >> RLS_SHIFT, S64_MAX >> 2);
+	if (denom <= 0)
+		return 0;
+
+	// a priori error with the current gains
+	acc = 0;
+	for (int i = 0; i < RLS_N; i++)
+		acc += (__int128)z[i] * gain[i];
+	err = y - rls_clamp(acc >> RLS_SHIFT, S64_MAX >> 2);
+
+	// k = phi / denom, gain += k * err with a clamped step
+	for (int i = 0; i < RLS_N; i++) {
+		s64 step;
+
+		k[i] = div64_s64(phi[i] << RLS_SHIFT, denom);
+		step = rls_clamp(((__int128)k[i] * err) >> RLS_SHIFT, max_step);
+		gain[i] = clamp_t(s64, gain[i] + step, 0, RLS_GAIN_MAX);
+	}
+
+	// P = (P - k phi') / lambda, kept symmetric and bounded
+	for (int i = 0; i < RLS_N; i++) {
+		for (int j = i; j < RLS_N; j++) {
+			__int128 v = P[i][j] -
+				     (((__int128)k[i] * phi[j]) >> RLS_SHIFT);
+			s64 p = rls_clamp((v * inv_lambda) >> RLS_SHIFT,
+					  RLS_P_MAX);
+
+			if (i == j && p < 0)
+				p = 0;
+			P[i][j] = p;
+			P[j][i] = p;
+		}
+	}
+
+	return err;
+}
+
+// Update the model with the package power the traced tasks should explain
+// over the interval since the last update. Called from the gather work.
+void pacct_model_update(s64 explained_mW)
+{
+	s64 z[RLS_N], y, maxabs, err;
+	u64 sums[RLS_N];
+	u64 now = ktime_get_ns();
+	u64 dt_ns;
+	bool outlier;
+	int shift;
+
+	// Always drain the sums, so that a disabled period doesn't pile up
+	for (int i = 0; i < RLS_N; i++)
+		sums[i] = atomic64_xchg(&interval_sums[i], 0);
+
+	if (!READ_ONCE(online_recalib))
+		return;
+
+	mutex_lock(&model_lock);
+	dt_ns = now - last_update_ns;
+	last_update_ns = now;
+	if (dt_ns == now || explained_mW <= 0)
+		goto out;
+
+	// uJ = mW * ns / 1e6
+	y = div64_s64(explained_mW * (s64)div_u64(dt_ns, 1000), 1000);
+	maxabs = y;
+	for (int i = 0; i < RLS_N; i++) {
+		// The model gives energy in uJ as count * koeff
+		z[i] = rls_clamp((__int128)sums[i] * tracked_events[i].koeff,
+				 S64_MAX >> 8);
+		maxabs = max(maxabs, abs(z[i]));
+	}
+	if (maxabs == 0)
+		goto out;
+
+	shift = fls64(maxabs) - RLS_NORM_BITS;
+	if (!norm_ready) {
+		norm_shift_avg = shift * RLS_AVG_ONE;
+		norm_ready = true;
+	}
+	outlier = shift * RLS_AVG_ONE >
+		  norm_shift_avg + RLS_OUTLIER_BITS * RLS_AVG_ONE;
+	norm_shift_avg += (shift * RLS_AVG_ONE - norm_shift_avg) / 8;
+	if (outlier) {
+		nr_outliers++;
+		goto out;
+	}
+
+	y = rls_norm(y, shift);
+	for (int i = 0; i < RLS_N; i++)
+		z[i] = rls_norm(z[i], shift);
+
+	err = rls_step(z, y);
+	fit_error_bp = (fit_error_bp * 7 +
+			div64_u64((u64)abs(err) * 10000, max_t(s64, y, 1))) >>
+		       3;
+	nr_updates++;
+
+	for (int i = 0; i < RLS_N; i++)
+		WRITE_ONCE(pacct_koeff[i],
+			   (s64)(((__int128)tracked_events[i].koeff * gain[i]) >>
+				 RLS_SHIFT));
+out:
+	mutex_unlock(&model_lock);
+}
+
+int pacct_model_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&model_lock);
+	seq_printf(m, "online_recalib %d\n", READ_ONCE(online_recalib));
+	seq_printf(m, "updates %llu\n", nr_updates);
+	seq_printf(m, "outliers %llu\n", nr_outliers);
+	seq_printf(m, "fit_error_bp %llu\n", fit_error_bp);
+	seq_puts(m, "event umask koeff gain_ppm base_koeff\n");
+	for (int i = 0; i < RLS_N; i++)
+		seq_printf(m, "0x%02x 0x%02x %lld %lld %lld\n",
+			   tracked_events[i].event_code, tracked_events[i].umask,
+			   READ_ONCE(pacct_koeff[i]),
+			   div_s64(gain[i] * 1000000, RLS_ONE),
+			   tracked_events[i].koeff);
+	mutex_unlock(&model_lock);
+	seq_printf(m, "negative_estimates %lld\n",
+		   atomic64_read(&pacct_negative_estimates));
+	return 0;
+}
@@ -0,0 +1,337 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/llist.h>
+#include <linux/rculist.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <net/genetlink.h>
+
+#include "pacct.h"
+#include "pacct_netlink.h"
+
+// Exit records are queued by the retire work, after the last deltas of the
+// task are folded, and multicast in batches from the estimator, so that a
+// burst of exits costs a few skbs and no work in the exit hook.
+
+// Bound of the exit records waiting for the next estimator pass
+static unsigned int netlink_max_pending = 4096;
+module_param(netlink_max_pending, uint, 0644);
+
+// Period of the per-tgid summaries in ms, 0 disables them
+static unsigned int netlink_summary_ms;
+module_param(netlink_summary_ms, uint, 0644);
+
+extern struct list_head traced_tasks;
+
+struct pacct_exit_node {
+	struct llist_node node;
+	struct pacct_exit_record rec;
+};
+
+static LLIST_HEAD(pending_exits);
+static atomic_t nr_pending = ATOMIC_INIT(0);
+static atomic64_t records_sent = ATOMIC64_INIT(0);
+static atomic64_t records_dropped = ATOMIC64_INIT(0);
+static u64 last_summary_ns;
+static bool family_registered;
+
+static int pacct_genl_get_stats(struct sk_buff *skb, struct genl_info *info);
+
+static const struct genl_small_ops pacct_genl_ops[] = {
+	{
+		.cmd = PACCT_CMD_GET_STATS,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.doit = pacct_genl_get_stats,
+	},
+};
+
+static const struct genl_multicast_group pacct_genl_mcgrps[] = {
+	{ .name = PACCT_GENL_MCGRP },
+};
+
+static struct genl_family pacct_genl_family __ro_after_init = {
+	.name = PACCT_GENL_NAME,
+	.version = PACCT_GENL_VERSION,
+	.maxattr = PACCT_A_MAX,
+	.module = THIS_MODULE,
+	.small_ops = pacct_genl_ops,
+	.n_small_ops = ARRAY_SIZE(pacct_genl_ops),
+	.resv_start_op = PACCT_CMD_GET_STATS + 1,
+	.mcgrps = pacct_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(pacct_genl_mcgrps),
+};
+
+static bool has_listeners(void)
+{
+	return family_registered &&
+	       genl_has_listeners(&pacct_genl_family, &init_net, 0);
+}
+
+static int pacct_genl_get_stats(struct sk_buff *skb, struct genl_info *info)
+{
+	struct sk_buff *msg;
+	void *hdr;
+
+	msg = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put_reply(msg, info, &pacct_genl_family, 0,
+				PACCT_CMD_GET_STATS);
+	if (!hdr ||
+	    nla_put_u64_64bit(msg, PACCT_A_SENT,
+			      atomic64_read(&records_sent), PACCT_A_PAD) ||
+	    nla_put_u64_64bit(msg, PACCT_A_DROPPED,
+			      atomic64_read(&records_dropped), PACCT_A_PAD)) {
+		nlmsg_free(msg);
+		return -EMSGSIZE;
+	}
+	genlmsg_end(msg, hdr);
+
+	return genlmsg_reply(msg, info);
+}
+
+// Queue the exit record of a task. Called from the retire work, once the
+// last deltas of the task are folded into its energy.
+void pacct_netlink_queue_exit(struct traced_task *e)
+{
+	struct pacct_exit_node *n;
+
+	if (!has_listeners())
+		return;
+
+	if (atomic_inc_return(&nr_pending) > READ_ONCE(netlink_max_pending)) {
+		atomic_dec(&nr_pending);
+		atomic64_inc(&records_dropped);
+		return;
+	}
+
+	n = kmalloc(sizeof(*n), GFP_KERNEL);
+	if (!n) {
+		atomic_dec(&nr_pending);
+		atomic64_inc(&records_dropped);
+		return;
+	}
+
+	n->rec = (struct pacct_exit_record){
+		.pid = e->pid,
+		.tgid = e->tgid,
+		.energy_uJ = atomic64_read(&e->energy),
+		.runtime_ns = e->total_exec_runtime_acc +
+			      atomic64_read(&e->delta_exec_runtime_acc),
+		.exit_ns = e->exit_ns,
+		.power_a_mW = atomic64_read(&e->power_a),
+		.power_w_mW = atomic64_read(&e->power_w),
+	};
+	memcpy(n->rec.comm, e->comm, PACCT_COMM_LEN);
+
+	llist_add(&n->node, &pending_exits);
+}
+
+struct pacct_batch {
+	struct sk_buff *skb;
+	void *hdr;
+	u8 cmd;
+	unsigned int nr; // records in the current skb
+};
+
+static void batch_send(struct pacct_batch *b)
+{
+	int ret;
+
+	if (!b->skb)
+		return;
+
+	genlmsg_end(b->skb, b->hdr);
+	ret = genlmsg_multicast(&pacct_genl_family, b->skb, 0, 0, GFP_KERNEL);
+	// -ESRCH only means that nobody listens anymore. Otherwise at least one
+	// listener didn't get the message, typically a full socket buffer.
+	if (ret && ret != -ESRCH)
+		atomic64_add(b->nr, &records_dropped);
+	else if (!ret)
+		atomic64_add(b->nr, &records_sent);
+
+	b->skb = NULL;
+	b->nr = 0;
+}
+
+static int batch_start(struct pacct_batch *b)
+{
+	b->skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!b->skb)
+		return -ENOMEM;
+
+	b->hdr = genlmsg_put(b->skb, 0, 0, &pacct_genl_family, 0, b->cmd);
+	if (!b->hdr ||
+	    nla_put_u64_64bit(b->skb, PACCT_A_DROPPED,
+			      atomic64_read(&records_dropped), PACCT_A_PAD)) {
+		nlmsg_free(b->skb);
+		b->skb = NULL;
+		return -EMSGSIZE;
+	}
+	return 0;
+}
+
+// Add a record to the batch, sending the current skb when it is full
+static int batch_add(struct pacct_batch *b, int attr, const void *data,
+		     int len)
+{
+	if (b->skb && nla_put(b->skb, attr, len, data) == 0)
+		goto added;
+
+	batch_send(b);
+	if (batch_start(b) || nla_put(b->skb, attr, len, data)) {
+		atomic64_inc(&records_dropped);
+		return -ENOMEM;
+	}
+added:
+	b->nr++;
+	return 0;
+}
+
+static void send_exit_records(void)
+{
+	struct llist_node *list = llist_del_all(&pending_exits);
+	struct pacct_batch b = { .cmd = PACCT_CMD_EXIT };
+	struct pacct_exit_node *n, *tmp;
+
+	if (!list)
+		return;
+
+	// Oldest first
+	list = llist_reverse_order(list);
+	llist_for_each_entry_safe(n, tmp, list, node) {
+		batch_add(&b, PACCT_A_RECORD, &n->rec, sizeof(n->rec));
+		atomic_dec(&nr_pending);
+		kfree(n);
+	}
+	batch_send(&b);
+}
+
+struct pacct_tgid_sample {
+	pid_t tgid;
+	pid_t pid;
+	u64 energy_uJ;
+	u64 power_w_mW;
+	char comm[TASK_COMM_LEN];
+};
+
+static int cmp_tgid_sample(const void *a, const void *b)
+{
+	const struct pacct_tgid_sample *x = a, *y = b;
+
+	return x->tgid < y->tgid ? -1 : x->tgid > y->tgid;
+}
+
+// Sum the traced tasks by thread group and multicast one summary per group
+static void send_tgid_summaries(void)
+{
+	struct pacct_batch b = { .cmd = PACCT_CMD_SUMMARY };
+	struct pacct_tgid_sample *samples;
+	struct traced_task *e;
+	unsigned int nr = 0, cap = 0;
+	u64 now = ktime_get_ns();
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(e, &traced_tasks, list)
+		cap++;
+	rcu_read_unlock();
+	if (!cap)
+		return;
+
+	samples = kvmalloc_array(cap, sizeof(*samples), GFP_KERNEL);
+	if (!samples)
+		return;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(e, &traced_tasks, list) {
+		if (nr == cap)
+			break;
+		samples[nr].tgid = e->tgid ?: e->pid;
+		samples[nr].pid = e->pid;
+		samples[nr].energy_uJ = atomic64_read(&e->energy);
+		samples[nr].power_w_mW = atomic64_read(&e->power_w);
+		memcpy(samples[nr].comm, e->comm, TASK_COMM_LEN);
+		nr++;
+	}
+	rcu_read_unlock();
+
+	sort(samples, nr, sizeof(*samples), cmp_tgid_sample, NULL);
+
+	for (unsigned int i = 0; i < nr;) {
+		struct pacct_tgid_summary s = {
+			.tgid = samples[i].tgid,
+			.ts_ns = now,
+		};
+
+		memcpy(s.comm, samples[i].comm, PACCT_COMM_LEN);
+		for (; i < nr && samples[i].tgid == s.tgid; i++) {
+			s.nr_tasks++;
+			s.energy_uJ += samples[i].energy_uJ;
+			s.power_w_mW += samples[i].power_w_mW;
+			// Name the group after its leader if it is traced
+			if (samples[i].pid == s.tgid)
+				memcpy(s.comm, samples[i].comm, PACCT_COMM_LEN);
+		}
+		batch_add(&b, PACCT_A_SUMMARY, &s, sizeof(s));
+	}
+	batch_send(&b);
+
+	kvfree(samples);
+}
+
+// Send what has piled up since the last pass. Called from the estimator.
+void pacct_netlink_flush(void)
+{
+	unsigned int period_ms = READ_ONCE(netlink_summary_ms);
+	u64 now;
+
+	send_exit_records();
+
+	if (!period_ms || !has_listeners())
+		return;
+
+	now = ktime_get_ns();
+	if (now - last_summary_ns < (u64)period_ms * NSEC_PER_MSEC)
+		return;
+	last_summary_ns = now;
+	send_tgid_summaries();
+}
+
+int pacct_netlink_init(void)
+{
+	int ret = genl_register_family(&pacct_genl_family);
+
+	if (ret) {
+		pr_err("Failed to register the generic netlink family: %d\n",
+		       ret);
+		return ret;
+	}
+	family_registered = true;
+	return 0;
+}
+
+// Must be called once the estimator and the hooks are stopped
+void pacct_netlink_exit(void)
+{
+	struct llist_node *list = llist_del_all(&pending_exits);
+	struct pacct_exit_node *n, *tmp;
+
+	llist_for_each_entry_safe(n, tmp, list, node)
+		kfree(n);
+
+	if (family_registered)
+		genl_unregister_family(&pacct_genl_family);
+	family_registered = false;
+}
+
+int pacct_netlink_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "listeners %d\n", has_listeners());
+	seq_printf(m, "pending %d\n", atomic_read(&nr_pending));
+	seq_printf(m, "sent %lld\n", atomic64_read(&records_sent));
+	seq_printf(m, "dropped %lld\n", atomic64_read(&records_dropped));
+	return 0;
+}
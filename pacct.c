@@ -5,9 +5,34 @@
 
 #include <linux/perf_event.h>
 #include <linux/timekeeping.h>
+#include <linux/hashtable.h>
+#include <linux/mutex.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
 
 extern spinlock_t traced_tasks_lock;
+extern struct mutex traced_tasks_walk_lock;
 extern struct list_head traced_tasks;
+extern DECLARE_HASHTABLE(traced_tasks_hash, PACCT_HASH_BITS);
+extern unsigned long *traced_pids;
+extern struct pacct_reclaim_stats reclaim_stats;
+extern struct workqueue_struct *pacct_wq;
+
+// Entries come from their own cache, they are allocated and freed at the rate
+// of the forks and exits
+static struct kmem_cache *traced_task_cache;
+
+int pacct_task_cache_init(void)
+{
+	traced_task_cache = KMEM_CACHE(traced_task, SLAB_HWCACHE_ALIGN);
+	return traced_task_cache ? 0 : -ENOMEM;
+}
+
+// Once all entries have been freed
+void pacct_task_cache_exit(void)
+{
+	kmem_cache_destroy(traced_task_cache);
+}
 
 struct traced_task *new_traced_task(pid_t pid)
 {
@@ -15,7 +40,7 @@ struct traced_task *new_traced_task(pid_t pid)
 
 	// Allocate and initialize a new traced_task entry
 	// Use GFP_ATOMIC since this will be called from an atomic context
-	entry = kzalloc(sizeof(*entry), GFP_ATOMIC);
+	entry = kmem_cache_zalloc(traced_task_cache, GFP_ATOMIC);
 	if (!entry) {
 		pr_err("Failed to allocate memory for traced_task\n");
 		return NULL;
@@ -26,6 +51,9 @@ struct traced_task *new_traced_task(pid_t pid)
 	entry->ready = false;
 	entry->retiring = false;
 	entry->needs_setup = true;
+	entry->per_process = false;
+	entry->counters_since_ns = 0;
+	entry->pmu_group = 0;
 	atomic64_set(&entry->energy, 0);
 	atomic64_set(&entry->power_a, 0);
 	atomic64_set(&entry->power_i, 0);
@@ -35,43 +63,83 @@ struct traced_task *new_traced_task(pid_t pid)
 	entry->total_exec_runtime_acc = 0;
 	entry->comm[0] = '\0';
 	atomic_set(&entry->record_count, 0);
+	entry->history = NULL;
 	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
 		entry->event[i] = NULL;
+		entry->pmu_rate[i] = 0;
 		entry->counts[i] = 0;
 		atomic64_set(&entry->diff_counts[i], 0);
 	}
-	setUpProcFile(entry);
+	// The proc files are created along with the counters, because creating
+	// them may sleep and we are called under traced_tasks_lock here.
 	return entry;
 }
 
+// Entries whose last reference has been dropped, waiting for their perf events
+// and memory to be released in process context.
+static LLIST_HEAD(released_traced_tasks);
+
+static void pacct_free_workfn(struct work_struct *work)
+{
+	struct llist_node *batch = llist_del_all(&released_traced_tasks);
+	struct traced_task *entry, *tmp;
+
+	pacct_hk_check(PACCT_WORK_FREE);
+
+	// The estimator may still be on one of the entries while it sleeps
+	mutex_lock(&traced_tasks_walk_lock);
+	llist_for_each_entry_safe(entry, tmp, batch, free_node) {
+		// Disable and release all events for this traced task
+		for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
+			if (entry->event[i] && !IS_ERR(entry->event[i])) {
+				pacct_pmu_account_teardown(i, entry->event[i]);
+				perf_event_disable(entry->event[i]);
+				perf_event_release_kernel(entry->event[i]);
+			}
+		}
+		freeProcFile(entry);
+		pacct_history_free(entry);
+		pacct_self_free(entry);
+		// Free the traced_task structure itself
+		kmem_cache_free(traced_task_cache, entry);
+		atomic64_inc(&reclaim_stats.freed);
+
+		cond_resched();
+	}
+	mutex_unlock(&traced_tasks_walk_lock);
+}
+
+static DECLARE_WORK(pacct_free_work, pacct_free_workfn);
+
 void release_traced_task(struct kref *kref)
 {
 	struct traced_task *entry =
 		container_of(kref, struct traced_task, ref_count);
 
-	// Disable and release all events for this traced task
-	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
-		if (entry->event[i] && !IS_ERR(entry->event[i])) {
-			perf_event_disable(entry->event[i]);
-			perf_event_release_kernel(entry->event[i]);
-		}
-	}
-	freeProcFile(entry);
-	// Free the traced_task structure itself
-	kfree(entry);
+	// The list's reference is dropped a grace period after the entry was
+	// unlinked, so no RCU reader can still see it. Releasing perf events may
+	// sleep though, so we only queue the entry here and tear it down in a
+	// batch from the free work.
+	if (llist_add(&entry->free_node, &released_traced_tasks))
+		queue_work_on(pacct_hk_cpu(), pacct_wq, &pacct_free_work);
+}
+
+void flush_released_traced_tasks(void)
+{
+	flush_work(&pacct_free_work);
 }
 
 static int setup_task_counter(pid_t pid, struct perf_event **event,
-			      u8 event_code, u8 umask)
+			      const struct pacct_pmu_event *pe, bool enable,
+			      bool inherit)
 {
 	int ret;
 	struct perf_event_attr attr;
 	struct task_struct *t;
-	u64 raw = (u64)event_code | ((u64)umask << 8);
 
 	memset(&attr, 0, sizeof(attr));
-	attr.type = PERF_TYPE_RAW;
-	attr.config = raw;
+	attr.type = pe->type;
+	attr.config = pe->config;
 	attr.size = sizeof(attr);
 
 	attr.disabled = 1;
@@ -79,6 +147,10 @@ static int setup_task_counter(pid_t pid, struct perf_event **event,
 	attr.exclude_user = 0;
 	attr.exclude_hv = 0;
 
+	// Shared with the threads created later, but not with child processes
+	attr.inherit = inherit;
+	attr.inherit_thread = inherit;
+
 	t = get_task_by_pid(pid);
 
 	if (!t) {
@@ -96,7 +168,8 @@ static int setup_task_counter(pid_t pid, struct perf_event **event,
 		goto err;
 	}
 
-	perf_event_enable(*event);
+	if (enable)
+		perf_event_enable(*event);
 	return 0;
 
 err:
@@ -106,65 +179,108 @@ err:
 int setup_traced_task_counters(struct traced_task *entry)
 {
 	int ret;
-	kref_get(&entry->ref_count);
+
+	// The caller holds a reference on the entry for the whole setup
+	if (!entry->proc_entry.process_dir)
+		setUpProcFile(entry);
+
+	// Threads started from now on inherit the counters of a process entry
+	if (entry->per_process && !entry->counters_since_ns)
+		WRITE_ONCE(entry->counters_since_ns, ktime_get_ns());
+
 	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
 		if (entry->event[i] && !IS_ERR(entry->event[i]))
 			continue; // Counter already set up for this event
+		if (pacct_pmu_events[i].group == PACCT_PMU_OFF)
+			continue; // Doesn't fit on the PMU
 
-		ret = setup_task_counter(entry->pid, &entry->event[i],
-					 tracked_events[i].event_code,
-					 tracked_events[i].umask);
+		// With rotation only the current subset of the task is enabled.
+		// Inherited counters are not rotated, perf multiplexes them.
+		ret = setup_task_counter(
+			entry->pid, &entry->event[i], &pacct_pmu_events[i],
+			entry->per_process ||
+				pacct_pmu_event_active(i, entry->pmu_group),
+			entry->per_process);
 		if (ret < 0) {
 			pr_err("Failed to set up counter for PID %d event code 0x%02x "
 			       "umask 0x%02x ret %d\n",
 			       entry->pid, tracked_events[i].event_code,
 			       tracked_events[i].umask, ret);
-			goto err;
+			return ret;
 		}
 	}
 	return 0;
-err:
-	kref_put(&entry->ref_count, release_traced_task);
-	return ret;
 }
 
-struct traced_task *get_or_create_traced_task(pid_t pid, const char *comm,
-					      bool create)
+// Take over the setup of an entry's counters. Returns false if the entry has
+// already been set up or somebody else is doing it.
+bool claim_traced_task_setup(struct traced_task *entry)
 {
-	struct traced_task *entry;
+	bool claimed;
 
 	spin_lock(&traced_tasks_lock);
-	list_for_each_entry(entry, &traced_tasks, list) {
-		if (entry->pid == pid) {
-			// Found an existing entry for this PID, increment refcount and return it
-			goto out;
-		}
+	claimed = !READ_ONCE(entry->ready) && READ_ONCE(entry->needs_setup);
+	if (claimed)
+		WRITE_ONCE(entry->needs_setup, false);
+	spin_unlock(&traced_tasks_lock);
+
+	return claimed;
+}
+
+// Look up the entry of a PID without taking traced_tasks_lock. Must be called
+// under rcu_read_lock(), the entry stays valid until rcu_read_unlock().
+struct traced_task *pacct_find_traced_task(pid_t pid)
+{
+	struct traced_task *entry;
+
+	hash_for_each_possible_rcu(traced_tasks_hash, entry, hnode, pid) {
+		if (entry->pid == pid)
+			return entry;
 	}
+	return NULL;
+}
 
-	if (!create) {
-		// No existing entry found and creation not allowed, return NULL
-		entry = NULL;
-		goto err;
+// Same as pacct_find_traced_task(), and create the entry if it doesn't exist
+// and create is set. Callers that sleep on the entry take a reference with
+// kref_get() before leaving the RCU read-side section.
+struct traced_task *get_or_create_traced_task(pid_t pid, pid_t tgid,
+					      const char *comm, bool create)
+{
+	struct traced_task *entry;
+
+	entry = pacct_find_traced_task(pid);
+	if (entry || !create)
+		return entry;
+
+	spin_lock(&traced_tasks_lock);
+	// Somebody may have created it since the lookup
+	hash_for_each_possible(traced_tasks_hash, entry, hnode, pid) {
+		if (entry->pid == pid)
+			goto out;
 	}
 
 	// No existing entry found, create a new one
 	entry = new_traced_task(pid);
 	if (!entry) {
 		pr_err("Failed to create traced task for PID %d\n", pid);
-		goto err;
+		goto out;
 	}
 
+	entry->tgid = tgid;
+	// Decided before the entry is visible to the setup work
+	entry->per_process = pacct_entry_is_process(pid, tgid);
+
 	if (comm) {
 		strncpy(entry->comm, comm, TASK_COMM_LEN - 1);
 		entry->comm[TASK_COMM_LEN - 1] = '\0';
 	}
 
-	list_add(&entry->list, &traced_tasks);
+	// The reference of the list, dropped when the entry is retired
+	list_add_rcu(&entry->list, &traced_tasks);
+	hash_add_rcu(traced_tasks_hash, &entry->hnode, pid);
+	set_bit(pid, traced_pids);
 
 out:
-	// Increment refcount for the new entry
-	kref_get(&entry->ref_count);
-err:
 	spin_unlock(&traced_tasks_lock);
 	return entry;
 }
\ No newline at end of file
@@ -1,10 +1,14 @@
 #pragma once
 
+#include <linux/cache.h>
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/kref.h>
 #include <linux/types.h>
 #include <linux/workqueue.h>
 #include <linux/proc_fs.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
 
 #define COUNTER_SCALE 100000000
 #define SCALE_COUNTER(counter) ((s64) ((double) COUNTER_SCALE * (counter)))
@@ -60,34 +64,87 @@ static struct {
 
 #define PACCT_TRACED_EVENT_COUNT ARRAY_SIZE(tracked_events)
 
+// Where a tracked event is counted, decided by pacct_pmu_init()
+struct pacct_pmu_event {
+	u32 type; // perf_event_attr type
+	u64 config; // perf_event_attr config
+	bool fixed; // expected to be on a fixed counter
+	s8 group; // rotation subset, or PACCT_PMU_ALWAYS / PACCT_PMU_OFF
+};
+
+#define PACCT_PMU_ALWAYS -1 // always counting
+#define PACCT_PMU_OFF -2 // not counted, dropped from the model
+
+#define PACCT_PMU_RATE_ONE (1ULL << 32)
+
+// Per-CPU counter read statistics, to see how much of the estimate is scaled
+struct pacct_pmu_cpu_stats {
+	u64 reads[PACCT_TRACED_EVENT_COUNT];
+	// reads that were scaled because the counter wasn't always running
+	u64 extrapolated[PACCT_TRACED_EVENT_COUNT];
+	// reads served by rdpmc, see pacct_pmu_read_fast()
+	u64 fast[PACCT_TRACED_EVENT_COUNT];
+	u64 rotations; // subset switches of a task
+};
+
+DECLARE_PER_CPU(struct pacct_pmu_cpu_stats, pacct_pmu_cpu_stats);
+
+// Number of bits of the PID hash table of traced tasks
+#define PACCT_HASH_BITS 12
+
 struct proc_entry {
 	struct proc_dir_entry *process_dir;
 };
 
+struct pacct_history;
+struct pacct_self;
+
+// The fields are grouped by who writes them, so that the CPU running a task
+// and the CPU running the estimator don't keep pulling the same cachelines
+// from each other:
+// - read-mostly: set up once, read by the hooks on every switch
+// - switch: written by the switch hook of the task's CPU
+// - estimator: written by the estimator on every pass
+// - cold: list and proc bookkeeping
 struct traced_task {
-	struct list_head list;
-	struct list_head retire_node; // Node for the retiring_traced_tasks list
-	struct kref ref_count; // Reference count for this traced task entry
+	// Read-mostly
 	pid_t pid;
+	pid_t tgid;
+	// Counts the whole thread group with inherited counters, see process.c
+	bool per_process;
 	bool ready;
 	bool retiring; // Flag to indicate if this task is being retired and should not be sampled anymore
 	bool needs_setup;
+	// Subset of events on the PMU when they are rotated, see pmu.c
+	u8 pmu_group;
 	struct perf_event *event[PACCT_TRACED_EVENT_COUNT];
+	struct hlist_node hnode; // Node for the traced_tasks_hash table
+	// Page mapped by the thread itself, see self.c
+	struct pacct_self *self;
+	// When the inherited counters were created, threads started before
+	// don't share them
+	u64 counters_since_ns;
 
+	// Switch
 	// pref counts for each event, updated on context switches
-	u64 counts[PACCT_TRACED_EVENT_COUNT];
+	u64 counts[PACCT_TRACED_EVENT_COUNT] ____cacheline_aligned_in_smp;
 	// estimated energy consumption based on the diff counts and coefficients
 	atomic64_t diff_counts[PACCT_TRACED_EVENT_COUNT];
 
 	// Execution runtime tracking for power estimation
 	u64 last_exec_runtime;
 	atomic64_t delta_exec_runtime_acc;
-	u64 total_exec_runtime_acc;
 
 	// Wall clock timestamp of the last context switch for this task, also used for power estimation
 	atomic64_t last_timestamp_ns;
 	atomic64_t delta_timestamp_acc;
 
+	// Number of times this task has been recorded in the energy estimation work.
+	atomic_t record_count;
+
+	// Estimator
+	u64 total_exec_runtime_acc ____cacheline_aligned_in_smp;
+
 	// estimated energy consumption
 	atomic64_t energy;
 	// estimated avg power consumption (based on execution runtime)
@@ -99,28 +156,249 @@ struct traced_task {
 	// but can still consume power due to background activity like memory accesses
 	atomic64_t power_w;
 
-	// Number of times this task has been recorded in the energy estimation work.
-	atomic_t record_count;
+	// Counts per ns of runtime (PACCT_PMU_RATE_ONE = 1.0) of each event when
+	// its subset was last on the PMU, used to extrapolate the other passes
+	u64 pmu_rate[PACCT_TRACED_EVENT_COUNT];
+
+	// Energy budget the task is charged to (-1 for none), as resolved for
+	// the budget_gen generation of the rules, and whether its utilization
+	// is clamped by it
+	u32 budget_gen;
+	s16 budget;
+	bool budget_clamped;
+
+	// Power time series, allocated once the task draws enough power
+	struct pacct_history *history;
+
+	// Cold
+	struct list_head list ____cacheline_aligned_in_smp;
+	struct list_head retire_node; // Node for the retiring_traced_tasks list
+	struct llist_node free_node; // Node for the deferred free list
+	struct kref ref_count; // Reference count for this traced task entry
 
 	char comm[TASK_COMM_LEN];
+	// When the task exited, 0 for the entries retired by the filter
+	u64 exit_ns;
 
 	struct proc_entry proc_entry; // Associated file under proc
 };
 
+// Counters for the reclamation of exited tasks
+struct pacct_reclaim_stats {
+	atomic64_t retired; // entries moved to retiring_traced_tasks on exit
+	atomic_t pending; // entries still waiting on retiring_traced_tasks
+	atomic64_t freed; // entries whose perf events and memory were released
+};
+
+// Progress of the initial attach to the pre-existing processes
+struct pacct_scan_stats {
+	atomic_t total; // processes in the snapshot
+	atomic_t done; // processes handled so far
+	atomic_t failed; // processes whose entry or counters couldn't be set up
+	u64 elapsed_ns; // time from the snapshot until all workers finished
+};
+
+// Snapshot of a process to attach, at load or on a filter rewrite
+struct pacct_scan_slot {
+	pid_t pid;
+	char comm[TASK_COMM_LEN];
+};
+
+// Per-CPU time split by the kind of task that ran, updated on context switches
+struct pacct_cpu_time {
+	u64 last_switch_ns; // local_clock() at the last context switch
+	u64 user_ns; // time spent in user tasks
+	u64 kthread_ns; // time spent in kernel threads
+};
+
+DECLARE_PER_CPU(struct pacct_cpu_time, pacct_cpu_time);
+
+// Fixed point 1.0 for pacct_residual_scale()
+#define PACCT_RESIDUAL_SCALE_ONE 1024
+
+// One interval of the package power split by where it went
+struct pacct_power_sample {
+	u64 ts_ns;
+	u64 pkg_mW; // measured by RAPL
+	u64 attributed_mW; // sum of power_w of the traced tasks
+	u64 kthread_mW; // estimated power of the kernel threads
+	u64 idle_mW; // estimated idle power of all CPUs
+	s64 residual_mW; // what the model doesn't explain
+	u32 residual_scale; // scale applied to the task energy
+};
+
+// Totals of the traced tasks, kept by the estimator as it updates them and
+// published once per pass
+struct pacct_power_snapshot {
+	u64 ts_ns; // end of the estimator pass
+	u64 period_ns; // since the previous pass
+	u32 tasks; // tasks the pass went through
+	u32 active; // of which have run since the previous pass
+	u64 energy_uJ; // charged to the traced tasks since load
+	u64 delta_uJ; // charged during the pass
+	u64 power_w_mW; // sum of power_w
+	u64 power_i_mW; // sum of power_i
+};
+
+// Background works of the module, see housekeeping.c
+enum pacct_work {
+	PACCT_WORK_SETUP,
+	PACCT_WORK_RETIRE,
+	PACCT_WORK_FREE,
+	PACCT_WORK_SCAN,
+	PACCT_WORK_ESTIMATE,
+	PACCT_WORK_GATHER,
+	PACCT_WORK_MSR, // RAPL MSR reads rather than a work
+	PACCT_WORK_NR,
+};
+
+// Number of tasks the estimator evaluates the model on at once
+#define PACCT_ESTIMATE_BATCH 64
+
+// Tasks gathered by the estimator, stored by event so that the model is
+// evaluated on whole rows of counter deltas, see wq.c
+struct pacct_estimate_batch {
+	u64 diff[PACCT_TRACED_EVENT_COUNT][PACCT_ESTIMATE_BATCH] __aligned(32);
+	s64 energy[PACCT_ESTIMATE_BATCH] __aligned(32); // count * koeff sums
+	u64 runtime_ns[PACCT_ESTIMATE_BATCH];
+	u64 wall_ns[PACCT_ESTIMATE_BATCH];
+	struct traced_task *task[PACCT_ESTIMATE_BATCH];
+	unsigned int nr;
+};
+
+// Upper bound of the top_n parameter
+#define PACCT_TOP_MAX 256
+
+// One task of the top power consumers index
+struct pacct_top_entry {
+	pid_t pid;
+	u64 power_w_mW;
+	u64 power_i_mW;
+	u64 energy_uJ;
+	char comm[TASK_COMM_LEN];
+};
+
+struct seq_file;
+
+int pacct_task_cache_init(void);
+void pacct_task_cache_exit(void);
 struct traced_task *new_traced_task(pid_t pid);
 void release_traced_task(struct kref *kref);
+void flush_released_traced_tasks(void);
 int setup_traced_task_counters(struct traced_task *entry);
-struct traced_task *get_or_create_traced_task(pid_t pid, const char *comm,
-					      bool create);
+bool claim_traced_task_setup(struct traced_task *entry);
+struct traced_task *pacct_find_traced_task(pid_t pid);
+struct traced_task *get_or_create_traced_task(pid_t pid, pid_t tgid,
+					      const char *comm, bool create);
+
+int pacct_hk_init(void);
+void pacct_hk_exit(void);
+bool pacct_hk_allowed(int cpu);
+unsigned int pacct_hk_nr_cpus(void);
+int pacct_hk_cpu(void);
+int pacct_hk_msr_cpu(void);
+void pacct_hk_check(enum pacct_work w);
+int pacct_hk_show(struct seq_file *m, void *v);
 
 void queue_pacct_setup_work(void);
 void queue_pacct_retire_work(void);
+void pacct_retire_traced_task(struct traced_task *e);
+void pacct_drain_traced_tasks(void);
 void queue_pacct_scan_tasks(void);
+int pacct_scan_snapshot(struct pacct_scan_slot **slots);
 void pacct_start_energy_estimator(void);
 void pacct_stop_energy_estimator(void);
+void pacct_estimate_batch_avx2(struct pacct_estimate_batch *b,
+			       const s64 *koeff);
+void pacct_power_snapshot(struct pacct_power_snapshot *out);
+int pacct_power_show(struct seq_file *m, void *v);
+
+void pacct_cpus_charge(const u64 *diffs, u64 runtime_ns);
+void pacct_cpus_charge_process(struct traced_task *e, u64 runtime_ns);
+void pacct_cpus_account(u64 delta_uJ);
+int pacct_cpus_show(struct seq_file *m, void *v);
+
+bool pacct_filter_match(struct task_struct *t);
+bool pacct_filter_has_comm(void);
+void pacct_filter_exit(void);
+extern const struct proc_ops pacct_filter_proc_ops;
+
+bool pacct_account_task(struct task_struct *prev, u64 *charged_ns);
+
+int pacct_sample_start(void);
+void pacct_sample_stop(void);
+int pacct_sample_show(struct seq_file *m, void *v);
+
+bool pacct_task_has_entry(struct task_struct *t);
+bool pacct_entry_is_process(pid_t pid, pid_t tgid);
+u64 pacct_record_process_runtime(struct traced_task *e, struct task_struct *t);
+void pacct_read_process_counts(struct traced_task *e);
+void pacct_per_thread_cleanup(void);
+extern const struct proc_ops pacct_per_thread_proc_ops;
+
+void pacct_history_record(struct traced_task *e, u64 energy_uJ, u64 runtime_ns);
+void pacct_history_free(struct traced_task *e);
+extern const struct proc_ops pacct_history_proc_ops;
+
+void pacct_top_begin(void);
+void pacct_top_offer(struct traced_task *e);
+void pacct_top_publish(void);
+unsigned int pacct_top_snapshot(struct pacct_top_entry *out, unsigned int max);
+int pacct_top_show(struct seq_file *m, void *v);
+
+int pacct_netlink_init(void);
+void pacct_netlink_exit(void);
+void pacct_netlink_queue_exit(struct traced_task *e);
+void pacct_netlink_flush(void);
+int pacct_netlink_show(struct seq_file *m, void *v);
+
+DECLARE_STATIC_KEY_FALSE(pacct_recording);
+int pacct_record_init(void);
+void pacct_record_exit(void);
+void pacct_record_switch(struct traced_task *e, u64 ts_ns, u64 exec_delta_ns,
+			 const u64 *delta);
+void pacct_record_rapl(u64 ts_ns, u64 energy_uJ);
+extern const struct proc_ops pacct_record_proc_ops;
+
+int pacct_self_init(void);
+void pacct_self_exit(void);
+void pacct_self_update(struct traced_task *e);
+void pacct_self_free(struct traced_task *e);
+int pacct_self_show(struct seq_file *m, void *v);
+
+void pacct_budget_begin(void);
+void pacct_budget_account(struct traced_task *e, u64 delta_uJ);
+void pacct_budget_end(void);
+void pacct_budget_retire(struct traced_task *e);
+void pacct_budget_fork(struct traced_task *e, struct task_struct *parent);
+void pacct_budget_exit(void);
+extern const struct proc_ops pacct_budget_proc_ops;
 
 struct task_struct *get_task_by_pid(pid_t pid);
-u64 read_event_count(struct perf_event *ev);
+u64 read_event_count(struct perf_event *ev, int idx);
+
+extern struct pacct_pmu_event pacct_pmu_events[PACCT_TRACED_EVENT_COUNT];
+extern unsigned int pacct_pmu_groups;
+
+int pacct_pmu_init(void);
+bool pacct_pmu_event_active(int i, u8 g);
+bool pacct_pmu_read_fast(struct perf_event *ev, u64 *val);
+void pacct_pmu_scale_diffs(struct traced_task *e, u64 *diff, u64 runtime_ns);
+void pacct_pmu_rotate(struct traced_task *e);
+void pacct_pmu_account_teardown(int i, struct perf_event *ev);
+int pacct_pmu_show(struct seq_file *m, void *v);
+
+s64 pacct_update_power_breakdown(u64 attributed_mW, u64 pkg_mW);
+u32 pacct_residual_scale(void);
+int pacct_breakdown_show(struct seq_file *m, void *v);
+
+// Effective coefficients of tracked_events[], recalibrated online if enabled
+extern s64 pacct_koeff[PACCT_TRACED_EVENT_COUNT];
+
+void pacct_model_init(void);
+void pacct_model_account(const u64 *sums);
+void pacct_model_update(s64 explained_mW);
+int pacct_model_show(struct seq_file *m, void *v);
 
 int powercap_init_caps(void);
 void powercap_cleanup_caps(void);
@@ -0,0 +1,58 @@
+#pragma once
+
+// Generic netlink interface of pacct_energy, shared with the userspace
+// consumers. Records are multicast on the PACCT_GENL_MCGRP group of the
+// PACCT_GENL_NAME family:
+//   PACCT_CMD_EXIT    - one PACCT_A_RECORD per task that exited since the
+//                       last message
+//   PACCT_CMD_SUMMARY - one PACCT_A_SUMMARY per thread group, periodically
+// Both carry PACCT_A_DROPPED, the total number of records lost so far.
+// PACCT_CMD_GET_STATS answers with PACCT_A_SENT and PACCT_A_DROPPED.
+
+#include <linux/types.h>
+
+#define PACCT_GENL_NAME "PACCT_ENERGY"
+#define PACCT_GENL_VERSION 1
+#define PACCT_GENL_MCGRP "events"
+
+enum {
+	PACCT_CMD_UNSPEC,
+	PACCT_CMD_EXIT,
+	PACCT_CMD_SUMMARY,
+	PACCT_CMD_GET_STATS,
+	__PACCT_CMD_MAX,
+};
+
+enum {
+	PACCT_A_UNSPEC,
+	PACCT_A_PAD,
+	PACCT_A_RECORD, // struct pacct_exit_record
+	PACCT_A_SUMMARY, // struct pacct_tgid_summary
+	PACCT_A_DROPPED, // u64
+	PACCT_A_SENT, // u64
+	__PACCT_A_MAX,
+};
+
+#define PACCT_A_MAX (__PACCT_A_MAX - 1)
+
+#define PACCT_COMM_LEN 16
+
+struct pacct_exit_record {
+	__u32 pid;
+	__u32 tgid;
+	__u64 energy_uJ;
+	__u64 runtime_ns;
+	__u64 exit_ns; // CLOCK_MONOTONIC
+	__u32 power_a_mW;
+	__u32 power_w_mW;
+	char comm[PACCT_COMM_LEN];
+};
+
+struct pacct_tgid_summary {
+	__u32 tgid;
+	__u32 nr_tasks; // traced tasks of the thread group
+	__u64 energy_uJ;
+	__u64 power_w_mW;
+	__u64 ts_ns; // CLOCK_MONOTONIC
+	char comm[PACCT_COMM_LEN];
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+// Binary format of the raw recording mode, shared with tools/pacct_record.
+// Each CPU has its own relay stream, made of records that all start with a
+// struct pacct_rec_header:
+//   PACCT_REC_SUBBUF - start of a relay sub-buffer, with the number of
+//                      records this CPU has dropped so far
+//   PACCT_REC_SWITCH - a traced task was switched out: its CPU time and the
+//                      counter deltas since it was switched in
+//   PACCT_REC_RAPL   - a read of the RAPL package energy counter
+// Records of the different CPUs are merged on ts_ns. Readers skip the
+// records of unknown type using their size.
+
+#include <linux/types.h>
+
+#define PACCT_REC_MAX_EVENTS 8
+
+enum {
+	PACCT_REC_SUBBUF = 1,
+	PACCT_REC_SWITCH,
+	PACCT_REC_RAPL,
+};
+
+struct pacct_rec_header {
+	__u16 type;
+	__u16 size; // of the whole record
+	__u16 cpu;
+	__u16 nr_events; // valid entries of pacct_switch_record.delta
+	__u32 pid; // 0 for records not about a task
+	__u32 counting; // PACCT_REC_SWITCH: bit i set if event i was counting
+	__u64 ts_ns; // CLOCK_MONOTONIC
+};
+
+struct pacct_subbuf_record {
+	struct pacct_rec_header hdr;
+	__u64 dropped;
+};
+
+struct pacct_switch_record {
+	struct pacct_rec_header hdr;
+	__u64 exec_delta_ns;
+	__u64 delta[PACCT_REC_MAX_EVENTS]; // in the order of tracked_events[]
+};
+
+struct pacct_rapl_record {
+	struct pacct_rec_header hdr;
+	__u64 energy_uJ; // raw package counter
+};
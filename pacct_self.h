@@ -0,0 +1,50 @@
+#pragma once
+
+// Self-measurement page of pacct_energy, shared with the applications. A
+// traced thread that opens /dev/pacct_self and maps one page of it gets a
+// read-only view of its own accounting, which it reads with plain loads:
+//
+//   int fd = open("/dev/pacct_self", O_RDONLY);
+//   const struct pacct_self_page *p =
+//           mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0);
+//   struct pacct_self_page s;
+//   pacct_self_read(p, &s);
+//
+// The page is updated when the thread is switched out and by every estimator
+// pass, so the values are as of update_ns. energy_uJ moves with the estimator
+// passes, runtime_ns and counts with the switches. For the threads of a
+// process traced as a whole (per_process=1), counts move with the passes.
+
+#include <linux/types.h>
+
+#define PACCT_SELF_DEVICE "/dev/pacct_self"
+#define PACCT_SELF_MAX_EVENTS 8
+
+struct pacct_self_page {
+	__u32 seq; // odd while an update is in progress
+	__u32 nr_events; // valid entries of counts
+	__u32 pid; // pid of the entry, the tgid for a process traced as a whole
+	__u32 pad;
+	__u64 update_ns; // CLOCK_MONOTONIC
+	__u64 energy_uJ;
+	__u64 runtime_ns;
+	__u64 power_w_mW;
+	__u64 counts[PACCT_SELF_MAX_EVENTS]; // raw counter values
+};
+
+#ifndef __KERNEL__
+// Consistent copy of the page, retried while an update is in progress
+static inline void pacct_self_read(const struct pacct_self_page *p,
+				   struct pacct_self_page *out)
+{
+	__u32 seq;
+
+	do {
+		seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		__builtin_memcpy(out, (const void *)p, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq & 1 || __atomic_load_n(&p->seq, __ATOMIC_RELAXED) != seq);
+}
+#endif
@@ -0,0 +1,192 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pacct_energy
+
+#if !defined(_PACCT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PACCT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "pacct.h"
+
+// Energy estimate of a task after an estimator pass
+TRACE_EVENT(pacct_task_energy,
+
+	TP_PROTO(struct traced_task *e, s64 delta_uJ, u64 runtime_ns),
+
+	TP_ARGS(e, delta_uJ, runtime_ns),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(s64, delta_uJ)
+		__field(u64, energy_uJ)
+		__field(u64, runtime_ns)
+		__field(u64, power_a_mW)
+		__field(u64, power_i_mW)
+		__field(u64, power_w_mW)
+	),
+
+	TP_fast_assign(
+		__entry->pid = e->pid;
+		memcpy(__entry->comm, e->comm, TASK_COMM_LEN);
+		__entry->delta_uJ = delta_uJ;
+		__entry->energy_uJ = atomic64_read(&e->energy);
+		__entry->runtime_ns = runtime_ns;
+		__entry->power_a_mW = atomic64_read(&e->power_a);
+		__entry->power_i_mW = atomic64_read(&e->power_i);
+		__entry->power_w_mW = atomic64_read(&e->power_w);
+	),
+
+	TP_printk("pid=%d comm=%s delta_uJ=%lld energy_uJ=%llu runtime_ns=%llu power_a_mW=%llu power_i_mW=%llu power_w_mW=%llu",
+		  __entry->pid, __entry->comm, __entry->delta_uJ,
+		  __entry->energy_uJ, __entry->runtime_ns, __entry->power_a_mW,
+		  __entry->power_i_mW, __entry->power_w_mW)
+);
+
+// Final accounting of a task that has exited, once the retire work has
+// folded its last deltas
+TRACE_EVENT(pacct_task_exit,
+
+	TP_PROTO(struct traced_task *e),
+
+	TP_ARGS(e),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(pid_t, tgid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(u64, energy_uJ)
+		__field(u64, runtime_ns)
+		__field(u64, power_a_mW)
+		__field(u64, power_w_mW)
+	),
+
+	TP_fast_assign(
+		__entry->pid = e->pid;
+		__entry->tgid = e->tgid;
+		memcpy(__entry->comm, e->comm, TASK_COMM_LEN);
+		__entry->energy_uJ = atomic64_read(&e->energy);
+		__entry->runtime_ns = e->total_exec_runtime_acc +
+				      atomic64_read(&e->delta_exec_runtime_acc);
+		__entry->power_a_mW = atomic64_read(&e->power_a);
+		__entry->power_w_mW = atomic64_read(&e->power_w);
+	),
+
+	TP_printk("pid=%d tgid=%d comm=%s energy_uJ=%llu runtime_ns=%llu power_a_mW=%llu power_w_mW=%llu",
+		  __entry->pid, __entry->tgid, __entry->comm,
+		  __entry->energy_uJ, __entry->runtime_ns, __entry->power_a_mW,
+		  __entry->power_w_mW)
+);
+
+// RAPL package counter read by the gather work, and the package power since
+// the previous read (0 for the first one)
+TRACE_EVENT(pacct_rapl_sample,
+
+	TP_PROTO(u64 raw_uJ, u64 dt_ns, u64 pkg_mW),
+
+	TP_ARGS(raw_uJ, dt_ns, pkg_mW),
+
+	TP_STRUCT__entry(
+		__field(u64, raw_uJ)
+		__field(u64, dt_ns)
+		__field(u64, pkg_mW)
+	),
+
+	TP_fast_assign(
+		__entry->raw_uJ = raw_uJ;
+		__entry->dt_ns = dt_ns;
+		__entry->pkg_mW = pkg_mW;
+	),
+
+	TP_printk("raw_uJ=%llu dt_ns=%llu pkg_mW=%llu", __entry->raw_uJ,
+		  __entry->dt_ns, __entry->pkg_mW)
+);
+
+// Sum of the per-task estimates against the measured package power
+TRACE_EVENT(pacct_power,
+
+	TP_PROTO(u64 estimated_mW, u64 pkg_mW, s64 explained_mW),
+
+	TP_ARGS(estimated_mW, pkg_mW, explained_mW),
+
+	TP_STRUCT__entry(
+		__field(u64, estimated_mW)
+		__field(u64, pkg_mW)
+		__field(s64, explained_mW)
+	),
+
+	TP_fast_assign(
+		__entry->estimated_mW = estimated_mW;
+		__entry->pkg_mW = pkg_mW;
+		__entry->explained_mW = explained_mW;
+	),
+
+	TP_printk("estimated_mW=%llu pkg_mW=%llu explained_mW=%lld",
+		  __entry->estimated_mW, __entry->pkg_mW,
+		  __entry->explained_mW)
+);
+
+// Decision of the power cap control loop
+TRACE_EVENT(pacct_powercap,
+
+	TP_PROTO(u64 pkg_mW, s32 target_mW, s32 old_khz, s32 new_khz),
+
+	TP_ARGS(pkg_mW, target_mW, old_khz, new_khz),
+
+	TP_STRUCT__entry(
+		__field(u64, pkg_mW)
+		__field(s32, target_mW)
+		__field(s32, old_khz)
+		__field(s32, new_khz)
+	),
+
+	TP_fast_assign(
+		__entry->pkg_mW = pkg_mW;
+		__entry->target_mW = target_mW;
+		__entry->old_khz = old_khz;
+		__entry->new_khz = new_khz;
+	),
+
+	TP_printk("pkg_mW=%llu target_mW=%d old_khz=%d new_khz=%d",
+		  __entry->pkg_mW, __entry->target_mW, __entry->old_khz,
+		  __entry->new_khz)
+);
+
+// Energy budget throttled or released by the estimator. value is the power
+// of the tasks of the budget (mW) or the energy of its window (uJ).
+TRACE_EVENT(pacct_budget,
+
+	TP_PROTO(unsigned int rule, bool energy, bool throttled, u64 value,
+		 u64 limit),
+
+	TP_ARGS(rule, energy, throttled, value, limit),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, rule)
+		__field(bool, energy)
+		__field(bool, throttled)
+		__field(u64, value)
+		__field(u64, limit)
+	),
+
+	TP_fast_assign(
+		__entry->rule = rule;
+		__entry->energy = energy;
+		__entry->throttled = throttled;
+		__entry->value = value;
+		__entry->limit = limit;
+	),
+
+	TP_printk("rule=%u kind=%s throttled=%d value=%llu limit=%llu",
+		  __entry->rule, __entry->energy ? "energy" : "power",
+		  __entry->throttled, __entry->value, __entry->limit)
+);
+
+#endif // _PACCT_TRACE_H
+
+// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pacct_trace
+#include <trace/define_trace.h>
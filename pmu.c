@@ -0,0 +1,299 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/perf_event.h>
+#include <linux/irqflags.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <asm/msr.h>
+#include <asm/perf_event.h>
+
+#include "pacct.h"
+
+// How the tracked events are put on the PMU when there are more of them than
+// general purpose counters:
+//   multiplex - create all events and let perf multiplex them (old behavior)
+//   reduce    - drop the events that don't fit, the model loses their energy
+//   rotate    - split the events into subsets that fit, and switch the subset
+//               of each task at every estimator pass
+static char *pmu_policy = "rotate";
+module_param(pmu_policy, charp, 0444);
+
+// Read the counters of the outgoing task with rdpmc when possible, instead of
+// going through perf_event_read_local()
+static bool fast_read = true;
+module_param(fast_read, bool, 0644);
+
+// Number of general purpose counters to use, 0 to use what the PMU reports.
+// Lower it if other users (e.g. the NMI watchdog) keep counters busy.
+static unsigned int pmu_gp_counters;
+module_param(pmu_gp_counters, uint, 0444);
+
+enum pacct_pmu_policy {
+	PACCT_PMU_MULTIPLEX,
+	PACCT_PMU_REDUCE,
+	PACCT_PMU_ROTATE,
+};
+
+static const char *const policy_names[] = {
+	[PACCT_PMU_MULTIPLEX] = "multiplex",
+	[PACCT_PMU_REDUCE] = "reduce",
+	[PACCT_PMU_ROTATE] = "rotate",
+};
+
+struct pacct_pmu_event pacct_pmu_events[PACCT_TRACED_EVENT_COUNT];
+unsigned int pacct_pmu_groups;
+
+static enum pacct_pmu_policy policy;
+static struct x86_pmu_capability pmu_cap;
+static unsigned int gp_counters;
+
+DEFINE_PER_CPU(struct pacct_pmu_cpu_stats, pacct_pmu_cpu_stats);
+
+// Time the events of exited tasks were enabled and running on the PMU
+static atomic64_t teardown_enabled[PACCT_TRACED_EVENT_COUNT];
+static atomic64_t teardown_running[PACCT_TRACED_EVENT_COUNT];
+
+// Architectural events with a fixed counter on Intel. Using the generic
+// hardware events lets perf put them there instead of on a GP counter.
+static const struct {
+	u8 event_code;
+	u8 umask;
+	u64 hw_config;
+	int fixed_idx;
+} fixed_events[] = {
+	{ 0xc0, 0x00, PERF_COUNT_HW_INSTRUCTIONS, 0 },
+	{ 0x3c, 0x00, PERF_COUNT_HW_CPU_CYCLES, 1 },
+};
+
+static bool map_to_fixed(int i)
+{
+	for (int f = 0; f < ARRAY_SIZE(fixed_events); f++) {
+		if (tracked_events[i].event_code != fixed_events[f].event_code ||
+		    tracked_events[i].umask != fixed_events[f].umask)
+			continue;
+		if (fixed_events[f].fixed_idx >= pmu_cap.num_counters_fixed)
+			return false;
+
+		pacct_pmu_events[i].type = PERF_TYPE_HARDWARE;
+		pacct_pmu_events[i].config = fixed_events[f].hw_config;
+		pacct_pmu_events[i].fixed = true;
+		pacct_pmu_events[i].group = PACCT_PMU_ALWAYS;
+		return true;
+	}
+	return false;
+}
+
+// Decide where each tracked event goes according to the PMU capacity. Must be
+// called before any counter is set up.
+int pacct_pmu_init(void)
+{
+	unsigned int nr_gp = 0, g;
+	int ret;
+
+	ret = sysfs_match_string(policy_names, pmu_policy);
+	if (ret < 0) {
+		pr_err("Unknown pmu_policy %s\n", pmu_policy);
+		return ret;
+	}
+	policy = ret;
+
+	perf_get_x86_pmu_capability(&pmu_cap);
+	gp_counters = pmu_gp_counters ?: pmu_cap.num_counters_gp;
+	if (pmu_gp_counters > pmu_cap.num_counters_gp)
+		gp_counters = pmu_cap.num_counters_gp;
+
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
+		struct pacct_pmu_event *pe = &pacct_pmu_events[i];
+
+		pe->type = PERF_TYPE_RAW;
+		pe->config = (u64)tracked_events[i].event_code |
+			     ((u64)tracked_events[i].umask << 8);
+		pe->fixed = false;
+		pe->group = PACCT_PMU_ALWAYS;
+		atomic64_set(&teardown_enabled[i], 0);
+		atomic64_set(&teardown_running[i], 0);
+
+		if (policy == PACCT_PMU_MULTIPLEX || map_to_fixed(i))
+			continue;
+		nr_gp++;
+	}
+
+	pacct_pmu_groups = 0;
+	if (policy != PACCT_PMU_MULTIPLEX && gp_counters &&
+	    nr_gp > gp_counters) {
+		// Hand out the GP events in table order: the first subset that
+		// fits is kept by the reduced model, with rotation every event
+		// belongs to the subset of its position.
+		g = 0;
+		for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
+			struct pacct_pmu_event *pe = &pacct_pmu_events[i];
+
+			if (pe->fixed)
+				continue;
+			if (policy == PACCT_PMU_REDUCE)
+				pe->group = g < gp_counters ? PACCT_PMU_ALWAYS :
+							      PACCT_PMU_OFF;
+			else
+				pe->group = g / gp_counters;
+			g++;
+		}
+		if (policy == PACCT_PMU_ROTATE)
+			pacct_pmu_groups = DIV_ROUND_UP(nr_gp, gp_counters);
+	}
+
+	pr_info("PMU: %d GP (using %u), %d fixed counters, %u GP events, policy %s, %u subsets\n",
+		pmu_cap.num_counters_gp, gp_counters, pmu_cap.num_counters_fixed,
+		nr_gp, policy_names[policy], pacct_pmu_groups);
+	return 0;
+}
+
+// Whether the counter of event i is enabled for a task currently in subset g
+bool pacct_pmu_event_active(int i, u8 g)
+{
+	s8 group = pacct_pmu_events[i].group;
+
+	return group == PACCT_PMU_ALWAYS || group == g;
+}
+
+// Read the count of an event straight from its hardware counter, the way the
+// x86 PMU driver updates it on a read. Only done while the event is on the PMU
+// of this CPU and has never been multiplexed, so that the count needs no
+// scaling, and with the interrupts off so that it can't be scheduled out
+// meanwhile. Returns false when perf_event_read_local() must be used instead.
+bool pacct_pmu_read_fast(struct perf_event *ev, u64 *val)
+{
+	struct hw_perf_event *hwc = &ev->hw;
+	u64 prev, count, raw;
+	int width;
+
+	if (!READ_ONCE(fast_read) || !irqs_disabled() || ev->attr.inherit ||
+	    READ_ONCE(ev->state) != PERF_EVENT_STATE_ACTIVE ||
+	    READ_ONCE(ev->oncpu) != smp_processor_id() || hwc->idx < 0 ||
+	    ev->total_time_enabled != ev->total_time_running)
+		return false;
+
+	width = hwc->event_base_rdpmc & INTEL_PMC_FIXED_RDPMC_BASE ?
+			pmu_cap.bit_width_fixed :
+			pmu_cap.bit_width_gp;
+	if (width <= 0 || width >= 64)
+		return false;
+
+	// An overflow NMI moves prev_count and count forward together, start
+	// over if one came in between
+	do {
+		prev = local64_read(&hwc->prev_count);
+		count = local64_read(&ev->count);
+		raw = native_read_pmc(hwc->event_base_rdpmc);
+	} while (local64_read(&hwc->prev_count) != prev);
+
+	// The counter is width bits wide, and may have wrapped since prev
+	*val = count + (((raw << (64 - width)) - (prev << (64 - width))) >>
+			(64 - width));
+	return true;
+}
+
+// Extrapolate the counts of the events that were not counting during the last
+// pass of the estimator. The counts per ns of runtime are remembered per task
+// from the last pass their subset was on the PMU, and scaled to the runtime of
+// this pass.
+void pacct_pmu_scale_diffs(struct traced_task *e, u64 *diff, u64 runtime_ns)
+{
+	if (!pacct_pmu_groups || !runtime_ns || e->per_process)
+		return;
+
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
+		if (pacct_pmu_events[i].group < 0)
+			continue;
+
+		if (pacct_pmu_events[i].group == e->pmu_group)
+			e->pmu_rate[i] = mul_u64_u64_div_u64(
+				diff[i], PACCT_PMU_RATE_ONE, runtime_ns);
+		else
+			diff[i] = mul_u64_u64_div_u64(e->pmu_rate[i], runtime_ns,
+						      PACCT_PMU_RATE_ONE);
+	}
+}
+
+// Move a task to the next subset of events. Called from the estimator in
+// process context, since enabling and disabling events may sleep.
+void pacct_pmu_rotate(struct traced_task *e)
+{
+	u8 old = e->pmu_group;
+	u8 next;
+
+	if (!pacct_pmu_groups || e->per_process || !READ_ONCE(e->ready))
+		return;
+	next = (old + 1) % pacct_pmu_groups;
+
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
+		struct perf_event *ev = READ_ONCE(e->event[i]);
+
+		if (!ev || IS_ERR(ev) || pacct_pmu_events[i].group != old)
+			continue;
+		perf_event_disable(ev);
+	}
+	WRITE_ONCE(e->pmu_group, next);
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
+		struct perf_event *ev = READ_ONCE(e->event[i]);
+
+		if (!ev || IS_ERR(ev) || pacct_pmu_events[i].group != next)
+			continue;
+		perf_event_enable(ev);
+	}
+	this_cpu_inc(pacct_pmu_cpu_stats.rotations);
+}
+
+// Remember how long the counter of an exiting task was multiplexed
+void pacct_pmu_account_teardown(int i, struct perf_event *ev)
+{
+	u64 enabled = 0, running = 0;
+
+	perf_event_read_value(ev, &enabled, &running);
+	atomic64_add(enabled, &teardown_enabled[i]);
+	atomic64_add(running, &teardown_running[i]);
+}
+
+int pacct_pmu_show(struct seq_file *m, void *v)
+{
+	u64 rotations = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		rotations += per_cpu(pacct_pmu_cpu_stats, cpu).rotations;
+
+	seq_printf(m, "policy %s\n", policy_names[policy]);
+	seq_printf(m, "gp_counters %d\n", pmu_cap.num_counters_gp);
+	seq_printf(m, "gp_used %u\n", gp_counters);
+	seq_printf(m, "fixed_counters %d\n", pmu_cap.num_counters_fixed);
+	seq_printf(m, "subsets %u\n", pacct_pmu_groups);
+	seq_printf(m, "rotations %llu\n", rotations);
+	seq_puts(m,
+		 "event umask counter subset reads fast extrapolated running_ppm\n");
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
+		struct pacct_pmu_event *pe = &pacct_pmu_events[i];
+		u64 reads = 0, fast = 0, extrapolated = 0;
+		u64 enabled = atomic64_read(&teardown_enabled[i]);
+		u64 running = atomic64_read(&teardown_running[i]);
+
+		for_each_possible_cpu(cpu) {
+			struct pacct_pmu_cpu_stats *s =
+				per_cpu_ptr(&pacct_pmu_cpu_stats, cpu);
+
+			reads += s->reads[i];
+			fast += s->fast[i];
+			extrapolated += s->extrapolated[i];
+		}
+
+		seq_printf(m, "0x%02x 0x%02x %s %d %llu %llu %llu %llu\n",
+			   tracked_events[i].event_code, tracked_events[i].umask,
+			   pe->group == PACCT_PMU_OFF ? "off" :
+			   pe->fixed ? "fixed" : "gp",
+			   pe->group, reads, fast, extrapolated,
+			   enabled ? mul_u64_u64_div_u64(running, 1000000,
+							 enabled) :
+				     1000000);
+	}
+	return 0;
+}
@@ -5,12 +5,12 @@
 #include <linux/cpufreq.h>
 
 #include "pacct.h"
+#include "pacct_trace.h"
 
 // CPU frequency scaling policy for P-cores
 struct cap_policy {
 	struct cpufreq_policy *policy;
 	struct freq_qos_request max_req;
-	bool req_added;
 };
 
 // Target package power in mW. The control loop will try to keep the total power
@@ -26,130 +26,247 @@ module_param(hysteresis_mW, int, 0644);
 static s32 step_khz = 100000;
 module_param(step_khz, int, 0644);
 
-static struct cap_policy caps[NR_CPUS];
-static int cap_cnt;
+// Policies with at least one online CPU, added and removed by the cpuhp
+// callbacks as the CPUs come and go. The requests are linked into the
+// constraints of their policy, so they are allocated one by one and only the
+// table of pointers is resized. With no policy at all (no cpufreq driver, or
+// all of its CPUs offline) the control loop only accounts.
+static DEFINE_MUTEX(caps_lock);
+static struct cap_policy **caps;
+static unsigned int cap_cnt;
+static unsigned int cap_size;
 static s32 current_cap_khz = -1;
 
-static int add_policy_cap_for_cpu(int cpu, s32 initial_max_khz)
+static enum cpuhp_state powercap_hp_state = CPUHP_INVALID;
+
+static void update_policy_max(struct cap_policy *c, s32 max_khz)
+{
+	// Make sure the new cap is within the CPU's supported frequency range
+	if (max_khz < c->policy->cpuinfo.min_freq)
+		max_khz = c->policy->cpuinfo.min_freq;
+	if (max_khz > c->policy->cpuinfo.max_freq)
+		max_khz = c->policy->cpuinfo.max_freq;
+
+	freq_qos_update_request(&c->max_req, max_khz);
+}
+
+static void free_policy_cap(struct cap_policy *c)
+{
+	freq_qos_remove_request(&c->max_req);
+	cpufreq_cpu_put(c->policy);
+	kfree(c);
+}
+
+// Cap the policy of a CPU coming online, unless it already is. Never fails
+// the hotplug: a policy that can't be capped is only accounted.
+static int powercap_cpu_online(unsigned int cpu)
 {
 	struct cpufreq_policy *pol;
+	struct cap_policy *c;
 	int ret;
 
 	pol = cpufreq_cpu_get(cpu);
 	if (!pol)
-		return -ENODEV;
+		return 0;
 
+	mutex_lock(&caps_lock);
 	// avoid duplicated policies
-	for (int i = 0; i < cap_cnt; i++) {
-		if (caps[i].policy == pol) {
+	for (unsigned int i = 0; i < cap_cnt; i++) {
+		if (caps[i]->policy == pol) {
 			cpufreq_cpu_put(pol);
-			return 0;
+			goto out;
+		}
+	}
+
+	if (cap_cnt == cap_size) {
+		unsigned int size = max(2 * cap_size, 8U);
+		struct cap_policy **table;
+
+		table = krealloc_array(caps, size, sizeof(*caps), GFP_KERNEL);
+		if (!table) {
+			ret = -ENOMEM;
+			goto err;
 		}
+		caps = table;
+		cap_size = size;
+	}
+
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c) {
+		ret = -ENOMEM;
+		goto err;
 	}
+	c->policy = pol;
 
-	caps[cap_cnt].policy = pol;
-	ret = freq_qos_add_request(&pol->constraints, &caps[cap_cnt].max_req,
-				   FREQ_QOS_MAX, initial_max_khz);
+	// A policy joining a running control loop starts at the current cap
+	ret = freq_qos_add_request(&pol->constraints, &c->max_req,
+				   FREQ_QOS_MAX, INT_MAX);
 	if (ret < 0) {
-		cpufreq_cpu_put(pol);
-		return ret;
+		kfree(c);
+		goto err;
 	}
-	caps[cap_cnt].req_added = true;
-	cap_cnt++;
+	if (current_cap_khz >= 0)
+		update_policy_max(c, current_cap_khz);
+
+	caps[cap_cnt++] = c;
+	pr_info("powercap: cpu=%u policy added, policies=%u\n", cpu, cap_cnt);
+out:
+	mutex_unlock(&caps_lock);
+	return 0;
+
+err:
+	mutex_unlock(&caps_lock);
+	cpufreq_cpu_put(pol);
+	pr_warn("powercap: cpu=%u not capped: %d\n", cpu, ret);
 	return 0;
 }
 
-static void update_policy_max(struct cap_policy *c, s32 max_khz)
+// Release the policy of a CPU going offline when it is the last online CPU
+// of the policy. Called before cpufreq stops the policy.
+static int powercap_cpu_offline(unsigned int cpu)
 {
-	if (!c->req_added)
-		return;
+	mutex_lock(&caps_lock);
+	for (unsigned int i = 0; i < cap_cnt; i++) {
+		struct cap_policy *c = caps[i];
+		unsigned int other;
 
-	// Make sure the new cap is within the CPU's supported frequency range
-	if (max_khz < c->policy->cpuinfo.min_freq)
-		max_khz = c->policy->cpuinfo.min_freq;
-	if (max_khz > c->policy->cpuinfo.max_freq)
-		max_khz = c->policy->cpuinfo.max_freq;
+		if (!cpumask_test_cpu(cpu, c->policy->related_cpus))
+			continue;
 
-	freq_qos_update_request(&c->max_req, max_khz);
+		for_each_cpu_and(other, c->policy->related_cpus,
+				 cpu_online_mask) {
+			if (other != cpu)
+				goto out;
+		}
+
+		caps[i] = caps[--cap_cnt];
+		free_policy_cap(c);
+		pr_info("powercap: cpu=%u policy removed, policies=%u\n", cpu,
+			cap_cnt);
+		break;
+	}
+out:
+	mutex_unlock(&caps_lock);
+	return 0;
 }
 
 void powercap_cleanup_caps(void)
 {
-	for (int i = 0; i < cap_cnt; i++) {
-		if (caps[i].req_added)
-			freq_qos_remove_request(&caps[i].max_req);
-		if (caps[i].policy)
-			cpufreq_cpu_put(caps[i].policy);
-	}
+	if (powercap_hp_state == CPUHP_INVALID)
+		return;
+
+	// The teardown callbacks would keep the policies whose other CPUs are
+	// still online, release them all here instead
+	cpuhp_remove_state_nocalls(powercap_hp_state);
+	powercap_hp_state = CPUHP_INVALID;
+
+	mutex_lock(&caps_lock);
+	for (unsigned int i = 0; i < cap_cnt; i++)
+		free_policy_cap(caps[i]);
+	kfree(caps);
+	caps = NULL;
 	cap_cnt = 0;
+	cap_size = 0;
+	mutex_unlock(&caps_lock);
+}
+
+// Report the task drawing the most power when we have to lower the cap
+static void report_top_offender(u64 pkg_power_mW)
+{
+	struct pacct_top_entry top;
+
+	if (!pacct_top_snapshot(&top, 1))
+		return;
+
+	pr_info_ratelimited("Package at %llu mW, top consumer PID %d (%s) at %llu mW\n",
+			    pkg_power_mW, top.pid, top.comm, top.power_w_mW);
 }
 
+// Must be called with caps_lock held
 static void apply_cap_to_all(s32 cap_khz)
 {
-	// apply the new cpu frequency to all policies∑among the cores
-	for (int i = 0; i < cap_cnt; i++)
-		update_policy_max(&caps[i], cap_khz);
+	// apply the new cpu frequency to all policies among the cores
+	for (unsigned int i = 0; i < cap_cnt; i++)
+		update_policy_max(caps[i], cap_khz);
+}
+
+// Highest maximum frequency of the policies, so that the first cap doesn't
+// limit any of them. Must be called with caps_lock held.
+static s32 max_policy_khz(void)
+{
+	s32 max_khz = 0;
+
+	for (unsigned int i = 0; i < cap_cnt; i++)
+		max_khz = max_t(s32, max_khz, caps[i]->policy->cpuinfo.max_freq);
+	return max_khz;
 }
 
 void pacct_powercap_control_step(u64 pkg_power_mW)
 {
+	s32 old_cap_khz;
+
+	mutex_lock(&caps_lock);
+	// Accounting only until a policy comes online
+	if (!cap_cnt)
+		goto out;
+
+	old_cap_khz = current_cap_khz;
 	if (current_cap_khz < 0) {
-		current_cap_khz = caps[0].policy->cpuinfo.max_freq;
+		current_cap_khz = max_policy_khz();
 		apply_cap_to_all(current_cap_khz);
-		return;
+		goto out;
 	}
 
 	// If the package power is above the target + hysteresis, reduce the CPU
 	// frequency cap by one step. If the package power is below the target
 	// hysteresis, increase the CPU frequency cap by one step.
 	if (pkg_power_mW > target_mW + hysteresis_mW) {
+		report_top_offender(pkg_power_mW);
 		current_cap_khz -= step_khz;
 		apply_cap_to_all(current_cap_khz);
 	} else if (pkg_power_mW < target_mW - hysteresis_mW) {
 		current_cap_khz += step_khz;
 		apply_cap_to_all(current_cap_khz);
 	}
+
+	trace_pacct_powercap(pkg_power_mW, target_mW, old_cap_khz,
+			     current_cap_khz);
+out:
+	mutex_unlock(&caps_lock);
 }
 
 int powercap_init_caps(void)
 {
-	int cpu, ret;
+	int ret;
 
-	cap_cnt = 0;
 	current_cap_khz = -1;
 
-	for_each_online_cpu(cpu) {
-		ret = add_policy_cap_for_cpu(cpu, INT_MAX);
-		if (ret && ret != -ENODEV) {
-			pr_err("add_policy_cap_for_cpu cpu=%d ret=%d\n", cpu,
-			       ret);
-			powercap_cleanup_caps();
-			return ret;
-		}
+	// Adds the policies of the online CPUs, and the ones of the CPUs that
+	// come online later
+	ret = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "pacct_energy:powercap",
+				powercap_cpu_online, powercap_cpu_offline);
+	if (ret < 0) {
+		pr_err("Failed to set up the powercap hotplug state: %d\n", ret);
+		return ret;
 	}
+	powercap_hp_state = ret;
 
+	mutex_lock(&caps_lock);
 	if (cap_cnt == 0) {
-		pr_err("no cpufreq policy found, cannot powercap\n");
-		return -ENODEV;
+		pr_info("powercap: no cpufreq policy yet, accounting only\n");
+		goto out;
 	}
 
 	// Set the initial cap to the maximum of the current max frequencies of all
 	// policies, so that we don't unnecessarily limit the frequency at the
-	// beginning.
-	current_cap_khz = caps[0].policy->cpuinfo.max_freq;
-	for (int i = 1; i < cap_cnt; i++) {
-		s32 m = caps[i].policy->cpuinfo.max_freq;
-		if (m > current_cap_khz)
-			current_cap_khz = m;
-	}
-
-	// Apply the initial cap to all policies. This is important to do before we
-	// start the control loop to ensure that we have a known starting point for
-	// the CPU frequency caps.
+	// beginning. This is important to do before we start the control loop to
+	// ensure that we have a known starting point for the CPU frequency caps.
+	current_cap_khz = max_policy_khz();
 	apply_cap_to_all(current_cap_khz);
 
-	pr_info("powercap: policies=%d initial_cap=%d kHz target=%d mW\n",
+	pr_info("powercap: policies=%u initial_cap=%d kHz target=%d mW\n",
 		cap_cnt, current_cap_khz, target_mW);
-
+out:
+	mutex_unlock(&caps_lock);
 	return 0;
-}
\ No newline at end of file
+}
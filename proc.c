@@ -2,6 +2,9 @@
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/debugfs.h>
+#include <linux/pid.h>
+#include <linux/rculist.h>
+#include <linux/sched.h>
 
 #include "pacct.h"
 #include "proc.h"
@@ -9,11 +12,116 @@
 #define PACCT_PROC_DIR "pacct_energy"
 struct proc_dir_entry *pacct_proc_dir;
 
+extern struct pacct_reclaim_stats reclaim_stats;
+extern struct pacct_scan_stats scan_stats;
+extern struct list_head traced_tasks;
+
+// Rough size of one line of the tasks file, to size its buffer up front
+#define PACCT_TASKS_LINE_SIZE 96
+
+static int pacct_reclaim_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "retired %lld\n", atomic64_read(&reclaim_stats.retired));
+	seq_printf(m, "pending %d\n", atomic_read(&reclaim_stats.pending));
+	seq_printf(m, "freed %lld\n", atomic64_read(&reclaim_stats.freed));
+	return 0;
+}
+
+static int pacct_scan_show(struct seq_file *m, void *v)
+{
+	int total = atomic_read(&scan_stats.total);
+	int done = atomic_read(&scan_stats.done);
+
+	seq_printf(m, "total %d\n", total);
+	seq_printf(m, "done %d\n", done);
+	seq_printf(m, "failed %d\n", atomic_read(&scan_stats.failed));
+	seq_printf(m, "elapsed_us %llu\n", READ_ONCE(scan_stats.elapsed_ns) / 1000);
+	seq_printf(m, "complete %d\n", READ_ONCE(scan_stats.elapsed_ns) != 0);
+	return 0;
+}
+
+static unsigned int count_traced_tasks(void)
+{
+	struct traced_task *e;
+	unsigned int nr = 0;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(e, &traced_tasks, list)
+		nr++;
+	rcu_read_unlock();
+
+	return nr;
+}
+
+// All traced tasks in one file, one per line, so that a tool can get them in
+// a single read. The list is walked under RCU, without holding off the hooks.
+static int pacct_tasks_show(struct seq_file *m, void *v)
+{
+	struct traced_task *e;
+
+	seq_puts(m,
+		 "pid tgid ppid energy_uJ power_a_mW power_i_mW power_w_mW runtime_us comm\n");
+	rcu_read_lock();
+	list_for_each_entry_rcu(e, &traced_tasks, list) {
+		struct task_struct *t;
+		pid_t ppid = 0;
+
+		t = pid_task(find_vpid(e->pid), PIDTYPE_PID);
+		if (t)
+			ppid = task_tgid_nr(rcu_dereference(t->real_parent));
+
+		seq_printf(m, "%d %d %d %lld %lld %lld %lld %llu %s\n", e->pid,
+			   e->tgid, ppid, atomic64_read(&e->energy),
+			   atomic64_read(&e->power_a), atomic64_read(&e->power_i),
+			   atomic64_read(&e->power_w),
+			   READ_ONCE(e->total_exec_runtime_acc) / NSEC_PER_USEC,
+			   e->comm);
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+static int pacct_tasks_open(struct inode *inode, struct file *file)
+{
+	size_t size = (size_t)(count_traced_tasks() + 64) * PACCT_TASKS_LINE_SIZE;
+
+	return single_open_size(file, pacct_tasks_show, NULL,
+				max_t(size_t, size, PAGE_SIZE));
+}
+
+static const struct proc_ops tasks_ops = {
+	.proc_open = pacct_tasks_open,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
 void init_proc() {
 	pacct_proc_dir = proc_mkdir(PACCT_PROC_DIR, NULL);
 	if (!pacct_proc_dir) {
 		pr_info("Failed to create /proc/%s", PACCT_PROC_DIR);
+		return;
 	}
+	proc_create_single("reclaim", 0444, pacct_proc_dir, pacct_reclaim_show);
+	proc_create_single("scan", 0444, pacct_proc_dir, pacct_scan_show);
+	proc_create_single("breakdown", 0444, pacct_proc_dir,
+			   pacct_breakdown_show);
+	proc_create_single("model", 0444, pacct_proc_dir, pacct_model_show);
+	proc_create_single("pmu", 0444, pacct_proc_dir, pacct_pmu_show);
+	proc_create("filter", 0644, pacct_proc_dir, &pacct_filter_proc_ops);
+	proc_create("per_thread", 0644, pacct_proc_dir,
+		    &pacct_per_thread_proc_ops);
+	proc_create("history", 0444, pacct_proc_dir, &pacct_history_proc_ops);
+	proc_create_single("top", 0444, pacct_proc_dir, pacct_top_show);
+	proc_create("tasks", 0444, pacct_proc_dir, &tasks_ops);
+	proc_create_single("netlink", 0444, pacct_proc_dir, pacct_netlink_show);
+	proc_create("record", 0644, pacct_proc_dir, &pacct_record_proc_ops);
+	proc_create_single("self", 0444, pacct_proc_dir, pacct_self_show);
+	proc_create_single("sample", 0444, pacct_proc_dir, pacct_sample_show);
+	proc_create_single("power", 0444, pacct_proc_dir, pacct_power_show);
+	proc_create_single("cpus", 0444, pacct_proc_dir, pacct_cpus_show);
+	proc_create_single("housekeeping", 0444, pacct_proc_dir, pacct_hk_show);
+	proc_create("budget", 0644, pacct_proc_dir, &pacct_budget_proc_ops);
 	pr_info("pacct_energy: /proc/%s created\n", PACCT_PROC_DIR);
 }
 
@@ -0,0 +1,202 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/perf_event.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/xarray.h>
+#include <linux/math64.h>
+
+#include "pacct.h"
+
+// Per-process mode. Instead of a counter set per thread, the thread-group
+// leader gets inherited counters that are shared with the threads it creates
+// afterwards, and the runtime of all threads is charged to the leader's entry.
+// Processes listed in /proc/pacct_energy/per_thread keep the per-thread
+// counters and entries.
+bool per_process;
+module_param(per_process, bool, 0444);
+
+// Thread-group IDs opted in for per-thread detail
+static DEFINE_XARRAY(per_thread_tgids);
+
+// Slice of the thread last charged on a CPU. A slice can be charged in parts,
+// at the samples of the sampling mode or at exit, and only what it ran since
+// is charged when it ends.
+struct pacct_charged_slice {
+	struct task_struct *task; // only compared, never dereferenced
+	u64 start; // prev_sum_exec_runtime of the slice
+	u64 charged; // sum_exec_runtime charged so far
+};
+
+static DEFINE_PER_CPU(struct pacct_charged_slice, charged_slice);
+
+static bool per_thread_wanted(pid_t tgid)
+{
+	return xa_load(&per_thread_tgids, tgid) != NULL;
+}
+
+// Whether a task gets its own entry. In per-process mode only the leaders do,
+// unless their process is opted in for per-thread detail. A process whose
+// leader already has a process entry stays traced as a whole: its new threads
+// inherit the leader's counters anyway, and an entry of their own would count
+// their events twice.
+bool pacct_task_has_entry(struct task_struct *t)
+{
+	struct traced_task *leader;
+	bool has_entry;
+
+	if (!per_process || t->pid == t->tgid)
+		return true;
+	if (!per_thread_wanted(t->tgid))
+		return false;
+
+	rcu_read_lock();
+	leader = pacct_find_traced_task(t->tgid);
+	has_entry = !leader || !leader->per_process;
+	rcu_read_unlock();
+	return has_entry;
+}
+
+// Whether the entry of a task counts its whole thread group
+bool pacct_entry_is_process(pid_t pid, pid_t tgid)
+{
+	return per_process && pid == tgid && !per_thread_wanted(tgid);
+}
+
+// Charge the slice a thread has just run to the entry of its process, and
+// return the runtime charged. Threads that existed before the counters were
+// created don't share them, so their runtime would dilute the energy of the
+// others. Called on the CPU the thread runs on.
+u64 pacct_record_process_runtime(struct traced_task *e, struct task_struct *t)
+{
+	u64 start = t->se.prev_sum_exec_runtime;
+	u64 runtime = t->se.sum_exec_runtime;
+	struct pacct_charged_slice *s;
+	unsigned long flags;
+	u64 delta, now, last;
+
+	if (t->pid != t->tgid && t->start_time < READ_ONCE(e->counters_since_ns))
+		return 0;
+
+	local_irq_save(flags);
+	s = this_cpu_ptr(&charged_slice);
+	if (s->task != t || s->start != start) {
+		s->task = t;
+		s->start = start;
+		s->charged = start;
+	}
+	delta = runtime > s->charged ? runtime - s->charged : 0;
+	s->charged = max(runtime, s->charged);
+	local_irq_restore(flags);
+
+	atomic64_add(delta, &e->delta_exec_runtime_acc);
+	pacct_cpus_charge_process(e, delta);
+
+	now = ktime_get_ns();
+	last = atomic64_xchg(&e->last_timestamp_ns, now);
+	if (last && now > last)
+		atomic64_add(now - last, &e->delta_timestamp_acc);
+
+	// The counts of the page only move with the estimator, which reads the
+	// inherited counters
+	if (unlikely(READ_ONCE(e->self)))
+		pacct_self_update(e);
+	return delta;
+}
+
+// Read the inherited counters of a process entry, including its threads, and
+// add what they counted since the last read to the diffs. Inherited events
+// can't be read with perf_event_read_local(), so this is done from the
+// estimator in process context.
+void pacct_read_process_counts(struct traced_task *e)
+{
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
+		struct perf_event *ev = READ_ONCE(e->event[i]);
+		u64 enabled = 0, running = 0, val;
+
+		if (!ev || IS_ERR(ev))
+			continue;
+
+		val = perf_event_read_value(ev, &enabled, &running);
+		this_cpu_inc(pacct_pmu_cpu_stats.reads[i]);
+		if (running < enabled) {
+			this_cpu_inc(pacct_pmu_cpu_stats.extrapolated[i]);
+			if (running)
+				val = mul_u64_u64_div_u64(val, enabled, running);
+		}
+
+		if (val > e->counts[i])
+			atomic64_add(val - e->counts[i], &e->diff_counts[i]);
+		e->counts[i] = val;
+	}
+}
+
+// Writing a TGID opts its process in for per-thread detail, "-TGID" opts it
+// out again. Only the threads created afterwards are affected, and only in
+// processes that aren't already traced as a whole.
+static ssize_t pacct_per_thread_write(struct file *file,
+				      const char __user *ubuf, size_t count,
+				      loff_t *ppos)
+{
+	bool remove = false;
+	char buf[16];
+	char *p = buf;
+	int tgid, ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (*p == '-') {
+		remove = true;
+		p++;
+	}
+	ret = kstrtoint(strim(p), 10, &tgid);
+	if (ret)
+		return ret;
+	if (tgid <= 0)
+		return -EINVAL;
+
+	if (remove) {
+		xa_erase(&per_thread_tgids, tgid);
+	} else {
+		ret = xa_err(xa_store(&per_thread_tgids, tgid, xa_mk_value(1),
+				      GFP_KERNEL));
+		if (ret)
+			return ret;
+	}
+
+	return count;
+}
+
+static int pacct_per_thread_show(struct seq_file *m, void *v)
+{
+	unsigned long tgid;
+	void *entry;
+
+	seq_printf(m, "# per_process %d\n", per_process);
+	xa_for_each(&per_thread_tgids, tgid, entry)
+		seq_printf(m, "%lu\n", tgid);
+	return 0;
+}
+
+static int pacct_per_thread_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pacct_per_thread_show, NULL);
+}
+
+const struct proc_ops pacct_per_thread_proc_ops = {
+	.proc_open = pacct_per_thread_open,
+	.proc_read = seq_read,
+	.proc_write = pacct_per_thread_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+void pacct_per_thread_cleanup(void)
+{
+	xa_destroy(&per_thread_tgids);
+}
@@ -0,0 +1,265 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/debugfs.h>
+#include <linux/jump_label.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/relay.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "pacct.h"
+#include "pacct_record.h"
+
+// Raw recording mode, to collect training data for the model. Every switch of
+// a traced task and every RAPL read is written as a fixed-size binary record
+// to a per-CPU relay buffer, in /sys/kernel/debug/pacct_energy/cpu<N>. The
+// buffers are allocated at load time when record_subbufs is set, and the
+// recording is started and stopped by writing 1 or 0 to
+// /proc/pacct_energy/record. Records that don't fit are dropped and counted,
+// the hooks never wait for the reader.
+
+// Number of sub-buffers per CPU, 0 disables the recording mode
+static unsigned int record_subbufs;
+module_param(record_subbufs, uint, 0444);
+
+// Size of one sub-buffer in KiB
+static unsigned int record_subbuf_kb = 256;
+module_param(record_subbuf_kb, uint, 0444);
+
+DEFINE_STATIC_KEY_FALSE(pacct_recording);
+
+struct pacct_record_cpu_stats {
+	u64 written;
+	u64 dropped;
+};
+
+static DEFINE_PER_CPU(struct pacct_record_cpu_stats, record_stats);
+
+static struct rchan *record_chan;
+static struct dentry *record_dir;
+// Serialises starting and stopping the recording
+static DEFINE_MUTEX(record_lock);
+
+// Called by relay on the CPU of the buffer when a writer moves to a new
+// sub-buffer. Refuse it while the reader hasn't consumed the oldest one.
+static int record_subbuf_start(struct rchan_buf *buf, void *subbuf,
+			       void *prev_subbuf, size_t prev_padding)
+{
+	struct pacct_subbuf_record *rec = subbuf;
+
+	if (relay_buf_full(buf))
+		return 0;
+
+	*rec = (struct pacct_subbuf_record){
+		.hdr = {
+			.type = PACCT_REC_SUBBUF,
+			.size = sizeof(*rec),
+			.cpu = buf->cpu,
+			.ts_ns = ktime_get_ns(),
+		},
+		.dropped = per_cpu(record_stats.dropped, buf->cpu),
+	};
+	subbuf_start_reserve(buf, sizeof(*rec));
+	return 1;
+}
+
+static struct dentry *record_create_buf_file(const char *filename,
+					     struct dentry *parent,
+					     umode_t mode,
+					     struct rchan_buf *buf,
+					     int *is_global)
+{
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
+
+static int record_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static const struct rchan_callbacks record_callbacks = {
+	.subbuf_start = record_subbuf_start,
+	.create_buf_file = record_create_buf_file,
+	.remove_buf_file = record_remove_buf_file,
+};
+
+// Room for a record in this CPU's buffer. Must be called with the interrupts
+// off, relay doesn't serialise the writers of a buffer.
+static void *record_reserve(size_t size)
+{
+	void *rec = relay_reserve(record_chan, size);
+
+	if (unlikely(!rec))
+		this_cpu_inc(record_stats.dropped);
+	else
+		this_cpu_inc(record_stats.written);
+	return rec;
+}
+
+// Called from the switch hook when a traced task is switched out, with the
+// interrupts off, and from the exit hook for its last slice, with them on
+void pacct_record_switch(struct traced_task *e, u64 ts_ns, u64 exec_delta_ns,
+			 const u64 *delta)
+{
+	struct pacct_switch_record *rec;
+	u8 group = READ_ONCE(e->pmu_group);
+	unsigned long flags;
+	u32 counting = 0;
+
+	local_irq_save(flags);
+	rec = record_reserve(sizeof(*rec));
+	if (!rec)
+		goto out;
+
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
+		struct perf_event *ev = READ_ONCE(e->event[i]);
+
+		if (ev && !IS_ERR(ev) && pacct_pmu_event_active(i, group))
+			counting |= BIT(i);
+	}
+
+	rec->hdr = (struct pacct_rec_header){
+		.type = PACCT_REC_SWITCH,
+		.size = sizeof(*rec),
+		.cpu = smp_processor_id(),
+		.nr_events = PACCT_TRACED_EVENT_COUNT,
+		.pid = e->pid,
+		.counting = counting,
+		.ts_ns = ts_ns,
+	};
+	rec->exec_delta_ns = exec_delta_ns;
+	memcpy(rec->delta, delta, PACCT_TRACED_EVENT_COUNT * sizeof(*delta));
+out:
+	local_irq_restore(flags);
+}
+
+// Called by the gather work for every read of the package counter
+void pacct_record_rapl(u64 ts_ns, u64 energy_uJ)
+{
+	struct pacct_rapl_record *rec;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	rec = record_reserve(sizeof(*rec));
+	if (rec) {
+		rec->hdr = (struct pacct_rec_header){
+			.type = PACCT_REC_RAPL,
+			.size = sizeof(*rec),
+			.cpu = smp_processor_id(),
+			.ts_ns = ts_ns,
+		};
+		rec->energy_uJ = energy_uJ;
+	}
+	local_irq_restore(flags);
+}
+
+static void record_stop(void)
+{
+	if (!static_key_enabled(&pacct_recording))
+		return;
+
+	static_branch_disable(&pacct_recording);
+	// Writers run with the interrupts off, wait for the ones in flight
+	synchronize_rcu();
+	// Make the partly filled sub-buffers visible to the reader
+	relay_flush(record_chan);
+}
+
+static ssize_t pacct_record_write(struct file *file, const char __user *ubuf,
+				  size_t count, loff_t *ppos)
+{
+	bool enable;
+	int ret;
+
+	ret = kstrtobool_from_user(ubuf, count, &enable);
+	if (ret)
+		return ret;
+
+	if (!record_chan)
+		return -ENODEV;
+
+	mutex_lock(&record_lock);
+	if (enable)
+		static_branch_enable(&pacct_recording);
+	else
+		record_stop();
+	mutex_unlock(&record_lock);
+
+	return count;
+}
+
+static int pacct_record_show(struct seq_file *m, void *v)
+{
+	int cpu;
+
+	seq_printf(m, "# enabled %d subbufs %u subbuf_kb %u\n",
+		   static_key_enabled(&pacct_recording), record_chan ?
+		   record_subbufs : 0, record_subbuf_kb);
+	seq_puts(m, "cpu written dropped\n");
+	for_each_possible_cpu(cpu) {
+		struct pacct_record_cpu_stats *s = per_cpu_ptr(&record_stats, cpu);
+
+		seq_printf(m, "%d %llu %llu\n", cpu, READ_ONCE(s->written),
+			   READ_ONCE(s->dropped));
+	}
+	return 0;
+}
+
+static int pacct_record_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pacct_record_show, NULL);
+}
+
+const struct proc_ops pacct_record_proc_ops = {
+	.proc_open = pacct_record_open,
+	.proc_read = seq_read,
+	.proc_write = pacct_record_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release,
+};
+
+int pacct_record_init(void)
+{
+	BUILD_BUG_ON(PACCT_TRACED_EVENT_COUNT > PACCT_REC_MAX_EVENTS);
+
+	if (!record_subbufs)
+		return 0;
+
+	record_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (IS_ERR(record_dir))
+		return PTR_ERR(record_dir);
+
+	record_chan = relay_open("cpu", record_dir,
+				 (size_t)record_subbuf_kb * SZ_1K,
+				 record_subbufs, &record_callbacks, NULL);
+	if (!record_chan) {
+		pr_err("Failed to allocate %u x %u KiB of relay buffers per CPU\n",
+		       record_subbufs, record_subbuf_kb);
+		debugfs_remove(record_dir);
+		record_dir = NULL;
+		return -ENOMEM;
+	}
+
+	pr_info("Recording mode available, %u x %u KiB per CPU\n",
+		record_subbufs, record_subbuf_kb);
+	return 0;
+}
+
+// Must be called once the hooks and the estimator are stopped
+void pacct_record_exit(void)
+{
+	if (!record_chan)
+		return;
+
+	mutex_lock(&record_lock);
+	record_stop();
+	mutex_unlock(&record_lock);
+
+	relay_close(record_chan);
+	record_chan = NULL;
+	debugfs_remove(record_dir);
+	record_dir = NULL;
+}
@@ -11,12 +11,34 @@ sync
 # Insert the kernel module
 sudo modprobe ./pacct_energy.ko enable_power_cap=1 target_mW=25000 
 
+# Record the estimated vs. measured package power and the cap decisions
+TRACING=/sys/kernel/tracing
+echo | sudo tee ${TRACING}/trace > /dev/null
+echo 1 | sudo tee ${TRACING}/events/pacct_energy/pacct_power/enable > /dev/null
+echo 1 | sudo tee ${TRACING}/events/pacct_energy/pacct_powercap/enable > /dev/null
+
 # Run a CPU stress test to generate some context switches and events
 sudo turbostat --Summary --show Avg_MHz,Busy%,PkgWatt --interval 1 --quiet -- taskset -c 0-11 stress-ng --cpu 80 --timeout 15s
 sleep 5 # For comparison
 
+# With C2C=1, also look for false sharing under a switch-heavy load: the
+# HITM counts of the module's cachelines between the scheduling CPUs and the
+# estimator
+if [ "${C2C}" = "1" ]; then
+	sudo perf c2c record -a -o pacct_c2c.data -- \
+		stress-ng --switch 12 --timeout 10s
+	sudo perf c2c report -i pacct_c2c.data --stdio --stats 2>/dev/null |
+		grep -iE 'HITM|Load Local|Load Remote'
+	sudo perf c2c report -i pacct_c2c.data --stdio -d lcl 2>/dev/null |
+		grep -B2 -A12 'Shared Data Cache Line Table' | head -n 40
+fi
+
+# Keep the trace before the events go away with the module
+sudo cat ${TRACING}/trace > pacct_trace.log
+
 # Remove the kernel module
 sudo rmmod pacct_energy
 
 # Display the contents of the log file
-sudo dmesg | tail -n 256
\ No newline at end of file
+sudo dmesg | tail -n 256
+grep -E 'pacct_(power|powercap):' pacct_trace.log | tail -n 64
\ No newline at end of file
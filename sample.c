@@ -0,0 +1,160 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/cpuhotplug.h>
+#include <linux/hrtimer.h>
+#include <linux/math.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+
+#include "pacct.h"
+
+// Sampling mode. With sample_hz set, the sched_switch probe is not registered
+// and a per-CPU timer charges the task running on its CPU instead, the way the
+// probe charges the task leaving it. The counters of a task only count while
+// it runs, so what is charged is still exact, but it is charged late: a task
+// is only seen at the samples that land on it, and whatever it ran since its
+// last sample is charged at the next one, or at exit. The cost of the module
+// no longer depends on the switch rate, but the one of perf still does: the
+// counters stay per task, so perf switches them in and out at every context
+// switch of a traced task.
+//
+// The isolated CPUs, outside the housekeeping mask, get no timer. A task that
+// runs there is charged when it next gets sampled on a housekeeping CPU, or
+// at exit.
+
+// Sampling rate in Hz, 0 hooks every context switch instead
+unsigned int sample_hz;
+module_param(sample_hz, uint, 0444);
+
+#define PACCT_SAMPLE_HZ_MAX 100000
+
+struct pacct_sample_cpu {
+	struct hrtimer timer;
+	bool armed; // not on the CPUs outside the housekeeping mask
+	u64 samples;
+	u64 hits; // samples that landed on a traced task
+	u64 charged_ns; // runtime charged at the hits
+	u64 lag_max_ns; // largest runtime charged at one hit
+};
+
+static DEFINE_PER_CPU(struct pacct_sample_cpu, sample_cpu);
+static ktime_t sample_period;
+static enum cpuhp_state sample_hp_state = CPUHP_INVALID;
+
+// Runs in hard interrupt context on the CPU of the timer, so that current is
+// the task that was interrupted
+static enum hrtimer_restart pacct_sample_timer_fn(struct hrtimer *timer)
+{
+	struct pacct_sample_cpu *s = this_cpu_ptr(&sample_cpu);
+	u64 charged_ns;
+
+	s->samples++;
+	if (pacct_account_task(current, &charged_ns)) {
+		s->hits++;
+		s->charged_ns += charged_ns;
+		if (charged_ns > s->lag_max_ns)
+			s->lag_max_ns = charged_ns;
+	}
+
+	hrtimer_forward_now(timer, sample_period);
+	return HRTIMER_RESTART;
+}
+
+// cpuhp callbacks, called on the CPU coming up or going down
+static int pacct_sample_cpu_online(unsigned int cpu)
+{
+	struct pacct_sample_cpu *s = &per_cpu(sample_cpu, cpu);
+
+	if (!pacct_hk_allowed(cpu))
+		return 0;
+
+	hrtimer_setup(&s->timer, pacct_sample_timer_fn, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL_PINNED_HARD);
+	hrtimer_start(&s->timer, sample_period, HRTIMER_MODE_REL_PINNED_HARD);
+	s->armed = true;
+	return 0;
+}
+
+static int pacct_sample_cpu_offline(unsigned int cpu)
+{
+	struct pacct_sample_cpu *s = &per_cpu(sample_cpu, cpu);
+
+	if (s->armed)
+		hrtimer_cancel(&s->timer);
+	s->armed = false;
+	return 0;
+}
+
+int pacct_sample_start(void)
+{
+	int ret;
+
+	if (!sample_hz)
+		return 0;
+	if (sample_hz > PACCT_SAMPLE_HZ_MAX) {
+		pr_err("sample_hz %u above %u\n", sample_hz,
+		       PACCT_SAMPLE_HZ_MAX);
+		return -EINVAL;
+	}
+
+	sample_period = ns_to_ktime(NSEC_PER_SEC / sample_hz);
+	ret = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "pacct_energy:sample",
+				pacct_sample_cpu_online,
+				pacct_sample_cpu_offline);
+	if (ret < 0) {
+		pr_err("Failed to start the sampling timers: %d\n", ret);
+		return ret;
+	}
+	sample_hp_state = ret;
+
+	pr_info("Sampling mode at %u Hz, the switch hook is not used\n",
+		sample_hz);
+	return 0;
+}
+
+// Stops the timers of all CPUs, none is running anymore on return
+void pacct_sample_stop(void)
+{
+	if (sample_hp_state == CPUHP_INVALID)
+		return;
+
+	cpuhp_remove_state(sample_hp_state);
+	sample_hp_state = CPUHP_INVALID;
+}
+
+int pacct_sample_show(struct seq_file *m, void *v)
+{
+	u64 samples = 0, hits = 0, share, ci;
+	int cpu;
+
+	seq_printf(m, "# sample_hz %u\n", sample_hz);
+	// Only the hook is replaced, see the top of this file
+	seq_puts(m, "# perf still switches the per-task counters at every context switch\n");
+	seq_puts(m, "cpu samples hits charged_ms lag_max_us\n");
+	for_each_possible_cpu(cpu) {
+		struct pacct_sample_cpu *s = per_cpu_ptr(&sample_cpu, cpu);
+		u64 n = READ_ONCE(s->samples);
+
+		if (!n)
+			continue;
+		samples += n;
+		hits += READ_ONCE(s->hits);
+		seq_printf(m, "%d %llu %llu %llu %llu\n", cpu, n,
+			   READ_ONCE(s->hits),
+			   div_u64(READ_ONCE(s->charged_ns), NSEC_PER_MSEC),
+			   div_u64(READ_ONCE(s->lag_max_ns), NSEC_PER_USEC));
+	}
+
+	// Share of the CPU time spent in traced tasks as seen by the samples,
+	// with the half width of its 95% confidence interval
+	if (samples) {
+		share = div64_u64(hits * 1000000, samples);
+		ci = div_u64(196 * (u64)int_sqrt64(div64_u64(
+					   share * (1000000 - share), samples)),
+			     100);
+		seq_printf(m, "traced_share_ppm %llu +- %llu\n", share, ci);
+	}
+	return 0;
+}
@@ -0,0 +1,207 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "pacct.h"
+#include "pacct_self.h"
+
+// Self-measurement pages. A traced thread opts in by opening /dev/pacct_self,
+// which gives its entry a page that the switch hook and the estimator keep
+// up to date, and that the thread maps read-only to sample its own
+// accounting without a syscall. The page is published with a sequence count
+// in the page itself, like the perf mmap page.
+
+struct pacct_self {
+	spinlock_t lock; // serialises the switch hook and the estimator
+	struct page *page;
+	struct pacct_self_page *p;
+};
+
+static atomic_t self_pages = ATOMIC_INIT(0);
+
+// Refresh the page of an entry. Called from the switch hook when the thread
+// is switched out, and from the estimator.
+void pacct_self_update(struct traced_task *e)
+{
+	struct pacct_self *s = smp_load_acquire(&e->self);
+	struct pacct_self_page *p;
+	unsigned long flags;
+
+	if (!s)
+		return;
+	p = s->p;
+
+	spin_lock_irqsave(&s->lock, flags);
+	WRITE_ONCE(p->seq, p->seq + 1);
+	smp_wmb();
+
+	p->update_ns = ktime_get_ns();
+	p->energy_uJ = atomic64_read(&e->energy);
+	p->runtime_ns = READ_ONCE(e->total_exec_runtime_acc) +
+			atomic64_read(&e->delta_exec_runtime_acc);
+	p->power_w_mW = atomic64_read(&e->power_w);
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++)
+		p->counts[i] = READ_ONCE(e->counts[i]);
+
+	smp_wmb();
+	WRITE_ONCE(p->seq, p->seq + 1);
+	spin_unlock_irqrestore(&s->lock, flags);
+}
+
+// Give an entry its page, or take a reference on the one it has
+static struct page *self_get_page(struct traced_task *e)
+{
+	static DEFINE_SPINLOCK(alloc_lock);
+	struct pacct_self *s, *old;
+
+	s = smp_load_acquire(&e->self);
+	if (s)
+		goto out;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+	s->page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!s->page) {
+		kfree(s);
+		return NULL;
+	}
+	spin_lock_init(&s->lock);
+	s->p = page_address(s->page);
+	s->p->pid = e->pid;
+	s->p->nr_events = PACCT_TRACED_EVENT_COUNT;
+
+	// Another thread of the same entry may have been faster
+	spin_lock(&alloc_lock);
+	old = e->self;
+	if (!old)
+		smp_store_release(&e->self, s);
+	spin_unlock(&alloc_lock);
+	if (old) {
+		__free_page(s->page);
+		kfree(s);
+		s = old;
+	} else {
+		atomic_inc(&self_pages);
+		pacct_self_update(e);
+	}
+
+out:
+	get_page(s->page);
+	return s->page;
+}
+
+void pacct_self_free(struct traced_task *e)
+{
+	struct pacct_self *s = e->self;
+
+	if (!s)
+		return;
+
+	// Mappings and open files hold their own reference on the page
+	put_page(s->page);
+	kfree(s);
+	e->self = NULL;
+	atomic_dec(&self_pages);
+}
+
+static int pacct_self_open(struct inode *inode, struct file *file)
+{
+	struct page *page = NULL;
+	struct traced_task *e;
+	int ret = -ESRCH;
+
+	BUILD_BUG_ON(PACCT_TRACED_EVENT_COUNT > PACCT_SELF_MAX_EVENTS);
+	BUILD_BUG_ON(sizeof(struct pacct_self_page) > PAGE_SIZE);
+
+	// Threads of a process traced as a whole share the process's page. Those
+	// of a process traced per thread without an entry of their own get none,
+	// the page of the leader doesn't count them.
+	rcu_read_lock();
+	e = pacct_find_traced_task(current->pid);
+	if (!e && current->pid != current->tgid) {
+		e = pacct_find_traced_task(current->tgid);
+		if (e && !e->per_process) {
+			rcu_read_unlock();
+			return -ENOENT;
+		}
+	}
+	if (e)
+		kref_get(&e->ref_count);
+	rcu_read_unlock();
+	if (!e)
+		return -ESRCH;
+
+	if (!READ_ONCE(e->retiring)) {
+		page = self_get_page(e);
+		ret = page ? 0 : -ENOMEM;
+	}
+	kref_put(&e->ref_count, release_traced_task);
+
+	file->private_data = page;
+	return ret;
+}
+
+static int pacct_self_release(struct inode *inode, struct file *file)
+{
+	put_page(file->private_data);
+	return 0;
+}
+
+static int pacct_self_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+	return vm_insert_page(vma, vma->vm_start, file->private_data);
+}
+
+static const struct file_operations pacct_self_fops = {
+	.owner = THIS_MODULE,
+	.open = pacct_self_open,
+	.release = pacct_self_release,
+	.mmap = pacct_self_mmap,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice pacct_self_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "pacct_self",
+	.fops = &pacct_self_fops,
+	.mode = 0444,
+};
+
+static bool self_registered;
+
+int pacct_self_init(void)
+{
+	int ret = misc_register(&pacct_self_dev);
+
+	if (ret) {
+		pr_err("Failed to register /dev/pacct_self: %d\n", ret);
+		return ret;
+	}
+	self_registered = true;
+	return 0;
+}
+
+void pacct_self_exit(void)
+{
+	if (self_registered)
+		misc_deregister(&pacct_self_dev);
+	self_registered = false;
+}
+
+int pacct_self_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "pages %d\n", atomic_read(&self_pages));
+	return 0;
+}
@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// pacct_record - drain the raw recording mode of pacct_energy to files
+//
+// The module must be loaded with record_subbufs set. Recording starts by
+// writing 1 to /proc/pacct_energy/record, and the per-CPU relay files under
+// /sys/kernel/debug/pacct_energy/ are copied as they fill to DIR/cpu<N>.bin,
+// one file per CPU so that the records of a CPU stay in order. On exit the
+// recording is stopped and what is left in the buffers is drained. The
+// format is described in pacct_record.h.
+//
+// Usage: pacct_record -o DIR [-t seconds]
+//        pacct_record -c FILE...
+//   -o  record into DIR until interrupted, or for -t seconds
+//   -c  convert recorded files to CSV on stdout, for the model fitting
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../pacct_record.h"
+
+#define CONTROL_FILE "/proc/pacct_energy/record"
+#define RELAY_DIR "/sys/kernel/debug/pacct_energy"
+#define MAX_CPUS 1024
+#define BUF_SIZE (1 << 20)
+
+struct cpu_stream {
+	int in, out;
+	unsigned long long bytes;
+};
+
+static struct cpu_stream streams[MAX_CPUS];
+static int nr_streams;
+static char buf[BUF_SIZE];
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static int set_recording(bool enable)
+{
+	int fd = open(CONTROL_FILE, O_WRONLY | O_CLOEXEC);
+	int ret = 0;
+
+	if (fd < 0 || write(fd, enable ? "1" : "0", 1) != 1) {
+		fprintf(stderr, "%s: %s\n", CONTROL_FILE, strerror(errno));
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int open_streams(const char *dir)
+{
+	char path[4096];
+
+	for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		struct cpu_stream *s = &streams[nr_streams];
+
+		snprintf(path, sizeof(path), RELAY_DIR "/cpu%d", cpu);
+		s->in = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (s->in < 0)
+			continue; // offline or not possible
+
+		snprintf(path, sizeof(path), "%s/cpu%d.bin", dir, cpu);
+		s->out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			      0644);
+		if (s->out < 0) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			return -1;
+		}
+		nr_streams++;
+	}
+
+	if (!nr_streams) {
+		fprintf(stderr, "no relay file in %s (record_subbufs not set?)\n",
+			RELAY_DIR);
+		return -1;
+	}
+	return 0;
+}
+
+// Copy what is available on a stream. Returns the number of bytes copied.
+static ssize_t drain_stream(struct cpu_stream *s)
+{
+	ssize_t total = 0;
+
+	for (;;) {
+		ssize_t len = read(s->in, buf, sizeof(buf));
+
+		if (len <= 0)
+			return len < 0 && errno != EAGAIN ? -1 : total;
+		if (write(s->out, buf, len) != len)
+			return -1;
+		s->bytes += len;
+		total += len;
+	}
+}
+
+static int record(const char *dir, double seconds)
+{
+	struct pollfd pfds[MAX_CPUS];
+	struct timespec start, now;
+	unsigned long long total = 0;
+	int ret = 0;
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+	if (open_streams(dir) || set_recording(true))
+		return 1;
+
+	for (int i = 0; i < nr_streams; i++)
+		pfds[i] = (struct pollfd){ .fd = streams[i].in, .events = POLLIN };
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!stop) {
+		if (poll(pfds, nr_streams, 100) < 0 && errno != EINTR)
+			break;
+
+		for (int i = 0; i < nr_streams; i++) {
+			if ((pfds[i].revents & POLLIN) &&
+			    drain_stream(&streams[i]) < 0) {
+				fprintf(stderr, "cpu stream %d: %s\n", i,
+					strerror(errno));
+				stop = 1;
+				ret = 1;
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (seconds > 0 && now.tv_sec - start.tv_sec +
+					   (now.tv_nsec - start.tv_nsec) / 1e9 >=
+				   seconds)
+			break;
+	}
+
+	// Stopping flushes the partly filled sub-buffers
+	set_recording(false);
+	for (int i = 0; i < nr_streams; i++) {
+		if (drain_stream(&streams[i]) < 0)
+			ret = 1;
+		total += streams[i].bytes;
+		close(streams[i].in);
+		close(streams[i].out);
+	}
+
+	fprintf(stderr, "%llu bytes recorded from %d CPUs, see %s for drops\n",
+		total, nr_streams, CONTROL_FILE);
+	return ret;
+}
+
+static void print_record(const struct pacct_rec_header *h)
+{
+	switch (h->type) {
+	case PACCT_REC_SWITCH: {
+		const struct pacct_switch_record *r = (const void *)h;
+
+		printf("switch,%u,%u,%llu,%llu,%#x", h->cpu, h->pid,
+		       (unsigned long long)h->ts_ns,
+		       (unsigned long long)r->exec_delta_ns, h->counting);
+		for (int i = 0; i < PACCT_REC_MAX_EVENTS; i++)
+			printf(",%llu", i < h->nr_events ?
+				       (unsigned long long)r->delta[i] : 0ULL);
+		printf("\n");
+		break;
+	}
+	case PACCT_REC_RAPL: {
+		const struct pacct_rapl_record *r = (const void *)h;
+
+		printf("rapl,%u,0,%llu,%llu\n", h->cpu,
+		       (unsigned long long)h->ts_ns,
+		       (unsigned long long)r->energy_uJ);
+		break;
+	}
+	case PACCT_REC_SUBBUF: {
+		const struct pacct_subbuf_record *r = (const void *)h;
+
+		printf("dropped,%u,0,%llu,%llu\n", h->cpu,
+		       (unsigned long long)h->ts_ns,
+		       (unsigned long long)r->dropped);
+		break;
+	}
+	}
+}
+
+static int convert(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	size_t len = 0, off = 0;
+
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	for (;;) {
+		size_t n = fread(buf + len, 1, sizeof(buf) - len, f);
+
+		len += n;
+		while (len - off >= sizeof(struct pacct_rec_header)) {
+			struct pacct_rec_header h;
+
+			memcpy(&h, buf + off, sizeof(h));
+			if (h.size < sizeof(h)) {
+				fprintf(stderr, "%s: corrupt record at %zu\n",
+					path, off);
+				fclose(f);
+				return 1;
+			}
+			if (len - off < h.size)
+				break;
+			print_record((const void *)(buf + off));
+			off += h.size;
+		}
+
+		memmove(buf, buf + off, len - off);
+		len -= off;
+		off = 0;
+		if (!n)
+			break;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s -o DIR [-t seconds]\n"
+		"       %s -c FILE...\n",
+		prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = NULL;
+	bool to_csv = false;
+	double seconds = 0;
+	int opt, ret = 0;
+
+	while ((opt = getopt(argc, argv, "o:t:ch")) != -1) {
+		switch (opt) {
+		case 'o':
+			dir = optarg;
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'c':
+			to_csv = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (to_csv) {
+		if (optind == argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		printf("type,cpu,pid,ts_ns,value,counting");
+		for (int i = 0; i < PACCT_REC_MAX_EVENTS; i++)
+			printf(",e%d", i);
+		printf("\n");
+		for (int i = optind; i < argc; i++)
+			ret |= convert(argv[i]);
+		return ret;
+	}
+
+	if (!dir) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	return record(dir, seconds);
+}
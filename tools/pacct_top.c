@@ -0,0 +1,444 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// pacct_top - show the energy and power of the traced processes as a tree
+//
+// Reads /proc/pacct_energy/tasks, which holds all traced tasks, with one
+// pread() per refresh on a descriptor kept open, and rebuilds the process
+// tree from the pid/ppid columns. Threads with their own entry hang below
+// their thread-group leader.
+//
+// Usage: pacct_top [-s energy|power_w|power_a] [-d seconds] [-n count]
+//                  [-l lines] [-b] [-f]
+//   -s  sort key, among siblings in the tree or globally with -f
+//   -d  refresh period in seconds (default 1)
+//   -n  number of refreshes, 0 for no limit (default 0, 1 with -b)
+//   -l  maximal number of lines shown (default: terminal height)
+//   -b  batch mode: CSV on stdout, no screen handling
+//   -f  flat list instead of a tree
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TASKS_FILE "/proc/pacct_energy/tasks"
+#define COMM_LEN 16
+#define NO_TASK -1
+
+enum sort_key { SORT_ENERGY, SORT_POWER_W, SORT_POWER_A };
+
+struct task {
+	int pid, tgid, ppid;
+	long long energy_uJ, power_a, power_i, power_w;
+	unsigned long long runtime_us;
+	char comm[COMM_LEN + 1];
+
+	// tree links, as indexes into the task array
+	int parent, first_child, next_sibling, depth;
+	long long subtree_energy_uJ;
+};
+
+static struct task *tasks;
+static size_t nr_tasks, cap_tasks;
+
+// Open addressing map from pid to task index
+static int *pid_map;
+static size_t pid_map_size;
+
+static char *buf;
+static size_t buf_size = 1 << 20;
+
+static enum sort_key sort_key = SORT_ENERGY;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static long long key_of(const struct task *t)
+{
+	switch (sort_key) {
+	case SORT_POWER_W:
+		return t->power_w;
+	case SORT_POWER_A:
+		return t->power_a;
+	case SORT_ENERGY:
+	default:
+		return t->energy_uJ;
+	}
+}
+
+static int cmp_tasks(const void *a, const void *b)
+{
+	long long ka = key_of(a), kb = key_of(b);
+
+	if (ka != kb)
+		return ka < kb ? 1 : -1;
+	return ((const struct task *)a)->pid - ((const struct task *)b)->pid;
+}
+
+// Read the whole file, growing the buffer until one read gets it all
+static ssize_t read_tasks_file(int fd)
+{
+	for (;;) {
+		ssize_t len = pread(fd, buf, buf_size - 1, 0);
+
+		if (len < 0)
+			return -1;
+		if ((size_t)len < buf_size - 1) {
+			buf[len] = '\0';
+			return len;
+		}
+
+		buf_size *= 2;
+		buf = realloc(buf, buf_size);
+		if (!buf)
+			return -1;
+	}
+}
+
+static int parse_tasks(void)
+{
+	char *line = strchr(buf, '\n'); // skip the header
+
+	nr_tasks = 0;
+	while (line && *++line) {
+		char *next = strchr(line, '\n');
+		struct task *t;
+		int comm_off = 0;
+
+		if (next)
+			*next = '\0';
+
+		if (nr_tasks == cap_tasks) {
+			cap_tasks = cap_tasks ? cap_tasks * 2 : 4096;
+			tasks = realloc(tasks, cap_tasks * sizeof(*tasks));
+			if (!tasks)
+				return -1;
+		}
+
+		t = &tasks[nr_tasks];
+		if (sscanf(line, "%d %d %d %lld %lld %lld %lld %llu %n", &t->pid,
+			   &t->tgid, &t->ppid, &t->energy_uJ, &t->power_a,
+			   &t->power_i, &t->power_w, &t->runtime_us,
+			   &comm_off) >= 8 &&
+		    comm_off) {
+			snprintf(t->comm, sizeof(t->comm), "%s",
+				 line + comm_off);
+			nr_tasks++;
+		}
+
+		line = next;
+	}
+	return 0;
+}
+
+static size_t pid_hash(int pid)
+{
+	return ((uint32_t)pid * 2654435761u) & (pid_map_size - 1);
+}
+
+static int build_pid_map(void)
+{
+	size_t want = 16;
+
+	while (want < nr_tasks * 2)
+		want *= 2;
+	if (want != pid_map_size) {
+		free(pid_map);
+		pid_map = malloc(want * sizeof(*pid_map));
+		if (!pid_map)
+			return -1;
+		pid_map_size = want;
+	}
+
+	for (size_t i = 0; i < pid_map_size; i++)
+		pid_map[i] = NO_TASK;
+	for (size_t i = 0; i < nr_tasks; i++) {
+		size_t h = pid_hash(tasks[i].pid);
+
+		while (pid_map[h] != NO_TASK)
+			h = (h + 1) & (pid_map_size - 1);
+		pid_map[h] = i;
+	}
+	return 0;
+}
+
+static int find_task(int pid)
+{
+	size_t h = pid_hash(pid);
+
+	while (pid_map[h] != NO_TASK) {
+		if (tasks[pid_map[h]].pid == pid)
+			return pid_map[h];
+		h = (h + 1) & (pid_map_size - 1);
+	}
+	return NO_TASK;
+}
+
+// Link every task to its parent. The tasks are sorted by the key beforehand,
+// and linked in reverse, so that the children of every node come out sorted.
+static void build_tree(void)
+{
+	for (size_t i = 0; i < nr_tasks; i++) {
+		tasks[i].first_child = NO_TASK;
+		tasks[i].next_sibling = NO_TASK;
+		tasks[i].subtree_energy_uJ = tasks[i].energy_uJ;
+	}
+
+	for (size_t n = nr_tasks; n-- > 0;) {
+		struct task *t = &tasks[n];
+		// Threads belong to their leader, processes to their parent
+		int parent_pid = t->pid != t->tgid ? t->tgid : t->ppid;
+		int p = find_task(parent_pid);
+
+		if (p == (int)n)
+			p = NO_TASK;
+		t->parent = p;
+		if (p != NO_TASK) {
+			t->next_sibling = tasks[p].first_child;
+			tasks[p].first_child = n;
+		}
+	}
+}
+
+// Iterative pre-order walk calling fn on each node, with its depth set
+static void walk_tree(void (*fn)(struct task *t, void *arg), void *arg)
+{
+	for (size_t r = 0; r < nr_tasks; r++) {
+		int cur = r;
+
+		if (tasks[r].parent != NO_TASK)
+			continue;
+
+		tasks[cur].depth = 0;
+		while (cur != NO_TASK) {
+			fn(&tasks[cur], arg);
+
+			if (tasks[cur].first_child != NO_TASK) {
+				int c = tasks[cur].first_child;
+
+				tasks[c].depth = tasks[cur].depth + 1;
+				cur = c;
+				continue;
+			}
+			// Go up until a node has a next sibling
+			while (cur != NO_TASK && tasks[cur].next_sibling == NO_TASK)
+				cur = tasks[cur].parent;
+			if (cur != NO_TASK) {
+				int s = tasks[cur].next_sibling;
+
+				tasks[s].depth = tasks[cur].depth;
+				cur = s;
+			}
+		}
+	}
+}
+
+// Post-order sums: every node is visited after all nodes that precede it in
+// pre-order, so accumulating in reverse pre-order gives the subtree totals.
+static int *order;
+static size_t order_len;
+
+static void collect_order(struct task *t, void *arg)
+{
+	(void)arg;
+	order[order_len++] = t - tasks;
+}
+
+static void sum_subtrees(void)
+{
+	order = realloc(order, (nr_tasks ? nr_tasks : 1) * sizeof(*order));
+	if (!order)
+		return;
+	order_len = 0;
+	walk_tree(collect_order, NULL);
+
+	for (size_t n = order_len; n-- > 0;) {
+		struct task *t = &tasks[order[n]];
+
+		if (t->parent != NO_TASK)
+			tasks[t->parent].subtree_energy_uJ +=
+				t->subtree_energy_uJ;
+	}
+}
+
+struct print_state {
+	int lines_left;
+	bool batch;
+};
+
+static void print_row(const struct task *t, int depth, bool batch)
+{
+	if (batch) {
+		printf("%d,%d,%d,%lld,%lld,%lld,%lld,%llu,%lld,%d,\"%s\"\n",
+		       t->pid, t->tgid, t->ppid, t->energy_uJ, t->power_a,
+		       t->power_i, t->power_w, t->runtime_us,
+		       t->subtree_energy_uJ, depth, t->comm);
+		return;
+	}
+
+	printf("%8d %12.3f %12.3f %9lld %9lld %10.3f  %*s%s\n", t->pid,
+	       t->energy_uJ / 1e6, t->subtree_energy_uJ / 1e6, t->power_w,
+	       t->power_a, t->runtime_us / 1e6, depth * 2, "", t->comm);
+}
+
+static void print_tree_node(struct task *t, void *arg)
+{
+	struct print_state *st = arg;
+
+	if (!st->batch && st->lines_left <= 0)
+		return;
+	st->lines_left--;
+	print_row(t, t->depth, st->batch);
+}
+
+static void print_flat_node(struct task *t, void *arg)
+{
+	struct print_state *st = arg;
+
+	if (!st->batch && st->lines_left <= 0)
+		return;
+	st->lines_left--;
+	print_row(t, 0, st->batch);
+}
+
+static void print_header(bool batch, bool flat)
+{
+	if (batch) {
+		printf("pid,tgid,ppid,energy_uJ,power_a_mW,power_i_mW,power_w_mW,runtime_us,subtree_energy_uJ,depth,comm\n");
+		return;
+	}
+
+	printf("\033[H\033[2J");
+	printf("pacct_top - %zu tasks, sorted by %s%s\n\n", nr_tasks,
+	       sort_key == SORT_ENERGY ? "energy" :
+	       sort_key == SORT_POWER_W ? "power_w" : "power_a",
+	       flat ? "" : ", tree");
+	printf("%8s %12s %12s %9s %9s %10s  %s\n", "PID", "ENERGY_J",
+	       "SUBTREE_J", "PWR_W_mW", "PWR_A_mW", "RUNTIME_s", "COMM");
+}
+
+static int terminal_lines(void)
+{
+	struct winsize ws;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 4)
+		return ws.ws_row - 4;
+	return 40;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-s energy|power_w|power_a] [-d seconds] [-n count] [-l lines] [-b] [-f]\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	bool batch = false, flat = false;
+	int count = -1, max_lines = 0, opt, fd;
+	double delay = 1.0;
+
+	while ((opt = getopt(argc, argv, "s:d:n:l:bfh")) != -1) {
+		switch (opt) {
+		case 's':
+			if (!strcmp(optarg, "energy"))
+				sort_key = SORT_ENERGY;
+			else if (!strcmp(optarg, "power_w"))
+				sort_key = SORT_POWER_W;
+			else if (!strcmp(optarg, "power_a"))
+				sort_key = SORT_POWER_A;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'd':
+			delay = atof(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'l':
+			max_lines = atoi(optarg);
+			break;
+		case 'b':
+			batch = true;
+			break;
+		case 'f':
+			flat = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (count < 0)
+		count = batch ? 1 : 0;
+	if (delay <= 0)
+		delay = 1.0;
+
+	fd = open(TASKS_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s (is the module loaded?)\n", TASKS_FILE,
+			strerror(errno));
+		return 1;
+	}
+
+	buf = malloc(buf_size);
+	if (!buf)
+		return 1;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	for (int iter = 0; !stop && (count == 0 || iter < count); iter++) {
+		struct print_state st = { .batch = batch };
+		struct timespec ts;
+
+		if (iter) {
+			ts.tv_sec = (time_t)delay;
+			ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+			nanosleep(&ts, NULL);
+			if (stop)
+				break;
+		}
+
+		if (read_tasks_file(fd) < 0 || parse_tasks() < 0) {
+			fprintf(stderr, "failed to read %s: %s\n", TASKS_FILE,
+				strerror(errno));
+			return 1;
+		}
+
+		qsort(tasks, nr_tasks, sizeof(*tasks), cmp_tasks);
+		if (build_pid_map() < 0)
+			return 1;
+		build_tree();
+		sum_subtrees();
+
+		st.lines_left = max_lines ? max_lines : terminal_lines();
+		print_header(batch, flat);
+		if (flat) {
+			for (size_t i = 0; i < nr_tasks; i++)
+				print_flat_node(&tasks[i], &st);
+		} else {
+			walk_tree(print_tree_node, &st);
+		}
+		fflush(stdout);
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,150 @@
+#define pr_fmt(fmt) "%s:%s():%d: " fmt, KBUILD_MODNAME, __func__, __LINE__
+
+#include <linux/seqlock.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+
+#include "pacct.h"
+
+// Index of the tasks with the highest power_w. The estimator offers every task
+// it updates to a bounded min-heap, so that a pass costs O(log N) per task,
+// and publishes the heap sorted at the end of the pass. Readers copy the
+// published array in O(N) whatever the number of traced tasks.
+
+static unsigned int top_n = 16;
+module_param(top_n, uint, 0444);
+
+// Heap being built by the current estimator pass, only used by the estimator
+static struct pacct_top_entry heap[PACCT_TOP_MAX];
+static unsigned int heap_len;
+
+// Result of the last complete pass, sorted by decreasing power_w
+static struct pacct_top_entry top[PACCT_TOP_MAX];
+static unsigned int top_len;
+static u64 top_ts_ns;
+static DEFINE_SEQLOCK(top_lock);
+
+static unsigned int top_cap(void)
+{
+	return clamp(top_n, 1U, (unsigned int)PACCT_TOP_MAX);
+}
+
+static void heap_swap(unsigned int a, unsigned int b)
+{
+	struct pacct_top_entry tmp = heap[a];
+
+	heap[a] = heap[b];
+	heap[b] = tmp;
+}
+
+static void heap_sift_down(unsigned int i, unsigned int len)
+{
+	for (;;) {
+		unsigned int l = 2 * i + 1, r = l + 1, min = i;
+
+		if (l < len && heap[l].power_w_mW < heap[min].power_w_mW)
+			min = l;
+		if (r < len && heap[r].power_w_mW < heap[min].power_w_mW)
+			min = r;
+		if (min == i)
+			return;
+		heap_swap(i, min);
+		i = min;
+	}
+}
+
+static void heap_sift_up(unsigned int i)
+{
+	while (i) {
+		unsigned int parent = (i - 1) / 2;
+
+		if (heap[parent].power_w_mW <= heap[i].power_w_mW)
+			return;
+		heap_swap(i, parent);
+		i = parent;
+	}
+}
+
+void pacct_top_begin(void)
+{
+	heap_len = 0;
+}
+
+// Offer a task that has just been updated by the estimator
+void pacct_top_offer(struct traced_task *e)
+{
+	u64 power_w = atomic64_read(&e->power_w);
+	bool replace = heap_len == top_cap();
+	struct pacct_top_entry *t;
+
+	if (!power_w)
+		return;
+
+	// When full, replace the smallest of the heap if this one is larger
+	if (replace && power_w <= heap[0].power_w_mW)
+		return;
+	t = replace ? &heap[0] : &heap[heap_len];
+
+	t->pid = e->pid;
+	t->power_w_mW = power_w;
+	t->power_i_mW = atomic64_read(&e->power_i);
+	t->energy_uJ = atomic64_read(&e->energy);
+	memcpy(t->comm, e->comm, TASK_COMM_LEN);
+
+	if (replace)
+		heap_sift_down(0, heap_len);
+	else
+		heap_sift_up(heap_len++);
+}
+
+// Sort the heap by decreasing power and make it the current top
+void pacct_top_publish(void)
+{
+	// Heap sort: the minimum goes to the end at each step
+	for (unsigned int len = heap_len; len > 1; len--) {
+		heap_swap(0, len - 1);
+		heap_sift_down(0, len - 1);
+	}
+
+	write_seqlock(&top_lock);
+	memcpy(top, heap, heap_len * sizeof(*heap));
+	top_len = heap_len;
+	top_ts_ns = ktime_get_ns();
+	write_sequnlock(&top_lock);
+}
+
+// Copy up to max entries of the current top into out, by decreasing power
+unsigned int pacct_top_snapshot(struct pacct_top_entry *out, unsigned int max)
+{
+	unsigned int n, seq;
+
+	do {
+		seq = read_seqbegin(&top_lock);
+		n = min(top_len, max);
+		memcpy(out, top, n * sizeof(*out));
+	} while (read_seqretry(&top_lock, seq));
+
+	return n;
+}
+
+int pacct_top_show(struct seq_file *m, void *v)
+{
+	struct pacct_top_entry *entries;
+	unsigned int n;
+
+	entries = kmalloc_array(PACCT_TOP_MAX, sizeof(*entries), GFP_KERNEL);
+	if (!entries)
+		return -ENOMEM;
+
+	n = pacct_top_snapshot(entries, PACCT_TOP_MAX);
+	seq_printf(m, "# ts_ms %llu\n", READ_ONCE(top_ts_ns) / NSEC_PER_MSEC);
+	seq_puts(m, "pid comm power_w_mW power_i_mW energy_uJ\n");
+	for (unsigned int i = 0; i < n; i++)
+		seq_printf(m, "%d %s %llu %llu %llu\n", entries[i].pid,
+			   entries[i].comm, entries[i].power_w_mW,
+			   entries[i].power_i_mW, entries[i].energy_uJ);
+
+	kfree(entries);
+	return 0;
+}
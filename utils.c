@@ -22,7 +22,8 @@ struct task_struct *get_task_by_pid(pid_t pid)
 	return task; // muss später put_task_struct()
 }
 
-u64 read_event_count(struct perf_event *ev)
+// Read the count of tracked event idx, scaled if the counter was multiplexed
+u64 read_event_count(struct perf_event *ev, int idx)
 {
 	// the time (in perf time units) the event was enabled (counting or not)
 	u64 enabled = 0;
@@ -32,12 +33,23 @@ u64 read_event_count(struct perf_event *ev)
 	if (!ev)
 		return 0;
 
-	// Read the raw count and scale it based on the time the event was enabled and running
+	// The outgoing task's events are usually still on the PMU of this CPU
 	u64 val;
+	if (pacct_pmu_read_fast(ev, &val)) {
+		this_cpu_inc(pacct_pmu_cpu_stats.reads[idx]);
+		this_cpu_inc(pacct_pmu_cpu_stats.fast[idx]);
+		return val;
+	}
+
+	// Read the raw count and scale it based on the time the event was enabled and running
 	int ret = perf_event_read_local(ev, &val, &enabled, &running);
 	if (ret)
 		return 0;
 
+	this_cpu_inc(pacct_pmu_cpu_stats.reads[idx]);
+	if (running < enabled)
+		this_cpu_inc(pacct_pmu_cpu_stats.extrapolated[idx]);
+
 	// Scale the raw count to account for time when the event was enabled but not running
 	u64 scaled =
 		(running ? mul_u64_u64_div_u64(val, enabled, running) : val);
@@ -6,23 +6,56 @@
 #include <linux/list.h>
 #include <linux/kref.h>
 #include <linux/hashtable.h>
+#include <linux/mutex.h>
+#include <linux/rculist.h>
 #include <linux/sched/signal.h>
+#include <linux/sched/task.h>
 #include <linux/perf_event.h>
+#include <linux/completion.h>
+#include <linux/slab.h>
+#include <linux/seqlock.h>
+#include <linux/seq_file.h>
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
 
 #include "pacct.h"
+#include "pacct_trace.h"
 
 #define PACCT_SETUP_BUDGET 32
 #define ENERGY_ESTIMATE_PERIOD_MS 30
 #define TOTAL_POWER_GATHER_PERIOD_MS 150
 
+extern struct workqueue_struct *pacct_wq;
 extern struct list_head traced_tasks;
 extern struct list_head retiring_traced_tasks;
 extern spinlock_t traced_tasks_lock;
+extern struct mutex traced_tasks_walk_lock;
+extern unsigned long *traced_pids;
 extern u64 total_power;
+extern struct pacct_reclaim_stats reclaim_stats;
+extern struct pacct_scan_stats scan_stats;
 extern u64 last_pkg_raw, last_ns;
 
 static atomic_t estimator_enabled = ATOMIC_INIT(0);
 
+// The estimator period adapts to the load: it is reset to
+// estimate_period_min_ms as soon as estimate_busy_tasks tasks have run during a
+// period, and stretched up to estimate_period_max_ms while fewer tasks are
+// active. Both works run on deferrable timers, so an idle CPU isn't woken up
+// just to find nothing to estimate.
+static unsigned int estimate_period_min_ms = ENERGY_ESTIMATE_PERIOD_MS;
+module_param(estimate_period_min_ms, uint, 0644);
+
+static unsigned int estimate_period_max_ms = 1000;
+module_param(estimate_period_max_ms, uint, 0644);
+
+static unsigned int estimate_busy_tasks = 4;
+module_param(estimate_busy_tasks, uint, 0644);
+
+// Current estimator period in ms, readable to see how far it has stretched
+static unsigned int estimate_period_ms = ENERGY_ESTIMATE_PERIOD_MS;
+module_param(estimate_period_ms, uint, 0444);
+
 static bool enable_power_cap = 0;
 module_param(enable_power_cap, bool, 0644);
 
@@ -56,6 +89,24 @@ static int rapl_read_pkg_energy_uj_on_cpu(int cpu, u64 *uj)
 	return 0;
 }
 
+// Retire an entry whose setup failed because its task is gone. The entry may
+// have been created after the exit hook of the task has run, from a snapshot
+// of the scan or a filter rewrite, and nothing else would ever retire it.
+static void pacct_retire_if_exited(struct traced_task *e)
+{
+	struct task_struct *t = get_task_by_pid(e->pid);
+	bool exited = !t || (t->flags & PF_EXITING);
+
+	if (t)
+		put_task_struct(t);
+	if (!exited)
+		return;
+
+	// Retiring twice is harmless if the exit hook got there first
+	WRITE_ONCE(e->retiring, true);
+	pacct_retire_traced_task(e);
+}
+
 static bool pick_one_not_ready_candidate(struct traced_task **out)
 {
 	struct traced_task *e;
@@ -80,6 +131,8 @@ static void pacct_setup_workfn(struct work_struct *work)
 {
 	int done = 0;
 
+	pacct_hk_check(PACCT_WORK_SETUP);
+
 	for (; done < PACCT_SETUP_BUDGET; done++) {
 		struct traced_task *e;
 
@@ -87,55 +140,146 @@ static void pacct_setup_workfn(struct work_struct *work)
 			break;
 
 		WRITE_ONCE(e->ready, setup_traced_task_counters(e) == 0);
+		if (!READ_ONCE(e->ready))
+			pacct_retire_if_exited(e);
 		kref_put(&e->ref_count, release_traced_task);
 
 		cond_resched();
 	}
+
+	// Budget used up, let other works run and continue with the rest later
+	if (done == PACCT_SETUP_BUDGET)
+		queue_pacct_setup_work();
 }
 
 static DECLARE_WORK(pacct_setup_work, pacct_setup_workfn);
 
 void queue_pacct_setup_work(void)
 {
-	queue_work(system_unbound_wq, &pacct_setup_work);
+	queue_work_on(pacct_hk_cpu(), pacct_wq, &pacct_setup_work);
 }
 
+// Exited tasks are reclaimed in batches. The retire work is kicked right away
+// once retire_high_water entries are pending, otherwise it runs at the latest
+// retire_max_age_ms after the first entry has been retired.
+static unsigned int retire_high_water = 64;
+module_param(retire_high_water, uint, 0644);
+
+static unsigned int retire_max_age_ms = 500;
+module_param(retire_max_age_ms, uint, 0644);
+
+static void pacct_estimate_retired(struct traced_task *e);
+
 static void pacct_retire_workfn(struct work_struct *work)
 {
-	struct traced_task *e;
+	struct traced_task *e, *n;
+	LIST_HEAD(batch);
 
-	for (;;) {
-		spin_lock(&traced_tasks_lock);
+	pacct_hk_check(PACCT_WORK_RETIRE);
 
-		if (list_empty(&retiring_traced_tasks)) {
-			spin_unlock(&traced_tasks_lock);
-			break;
+	// Take the whole retiring list at once to keep the lock hold time short
+	spin_lock(&traced_tasks_lock);
+	list_splice_init(&retiring_traced_tasks, &batch);
+	spin_unlock(&traced_tasks_lock);
+
+	if (list_empty(&batch))
+		return;
+
+	// The hooks and the other RCU readers that found these entries before
+	// they were unlinked are done after this, for the whole batch at once
+	synchronize_rcu();
+
+	// Fold the deltas of the last switches, which the estimator skips once
+	// the entries are retiring, before the exit records go out. The walk
+	// lock keeps the estimator off the entries it may still have in a batch.
+	mutex_lock(&traced_tasks_walk_lock);
+	list_for_each_entry(e, &batch, retire_node) {
+		pacct_estimate_retired(e);
+		pacct_budget_retire(e);
+		if (e->exit_ns) {
+			trace_pacct_task_exit(e);
+			pacct_netlink_queue_exit(e);
 		}
+	}
+	mutex_unlock(&traced_tasks_walk_lock);
 
-		e = list_first_entry(&retiring_traced_tasks, struct traced_task,
-				     retire_node);
+	list_for_each_entry_safe(e, n, &batch, retire_node) {
 		list_del_init(&e->retire_node);
-		spin_unlock(&traced_tasks_lock);
+		atomic_dec(&reclaim_stats.pending);
 
+		// Drop the reference held by the traced_tasks list. The perf events
+		// are released in bulk by the free work once the last user is gone.
 		kref_put(&e->ref_count, release_traced_task);
-
-		cond_resched();
 	}
 }
 
-static DECLARE_WORK(pacct_retire_work, pacct_retire_workfn);
+static DECLARE_DELAYED_WORK(pacct_retire_work, pacct_retire_workfn);
 
 void queue_pacct_retire_work(void)
 {
-	queue_work(system_unbound_wq, &pacct_retire_work);
+	if (atomic_read(&reclaim_stats.pending) >= READ_ONCE(retire_high_water))
+		mod_delayed_work_on(pacct_hk_cpu(), pacct_wq,
+				    &pacct_retire_work, 0);
+	else
+		queue_delayed_work_on(pacct_hk_cpu(), pacct_wq,
+				      &pacct_retire_work,
+				      msecs_to_jiffies(retire_max_age_ms));
 }
 
-// Estimate the energy from the counters via the model and calculate the power for each traced task
-static __inline__ void pacct_estimate_traced_task_energy(struct traced_task *e)
+// Move an exited task from traced_tasks to the retiring list and schedule its
+// reclamation. Safe to call from the trace hooks, and more than once when a
+// filter change races with the exit of the task.
+void pacct_retire_traced_task(struct traced_task *e)
+{
+	spin_lock(&traced_tasks_lock);
+	if (!hash_hashed(&e->hnode)) {
+		spin_unlock(&traced_tasks_lock);
+		return;
+	}
+	list_del_rcu(&e->list);
+	hash_del_rcu(&e->hnode);
+	clear_bit(e->pid, traced_pids);
+	list_add_tail(&e->retire_node, &retiring_traced_tasks);
+	spin_unlock(&traced_tasks_lock);
+
+	atomic64_inc(&reclaim_stats.retired);
+	atomic_inc(&reclaim_stats.pending);
+
+	queue_pacct_retire_work();
+}
+
+// Evaluate the model with the vector kernel when the CPU has AVX2
+static bool estimate_simd = true;
+module_param(estimate_simd, bool, 0644);
+
+// Only used by the estimator work, which never runs concurrently with itself
+static struct pacct_estimate_batch estimate_batch;
+// Same for the retire work
+static struct pacct_estimate_batch retire_batch;
+// Energy of the retired entries, added to the totals of the next pass
+static atomic64_t retired_uJ = ATOMIC64_INIT(0);
+// Estimates the model made negative, charged as 0. Shown with the model.
+atomic64_t pacct_negative_estimates = ATOMIC64_INIT(0);
+// Totals of the pass in progress, also only touched by the estimator
+static struct pacct_power_snapshot pass_totals;
+
+// Totals of the last complete pass
+static struct pacct_power_snapshot power_snapshot;
+static DEFINE_SEQLOCK(power_snapshot_lock);
+
+// Read and reset the counter deltas of a traced task into the next slot of
+// the batch. The counter diffs are added to sums for the online
+// recalibration of the model.
+static void pacct_estimate_gather(struct pacct_estimate_batch *b,
+				  struct traced_task *e, u64 *sums)
 {
 	u64 diff_count[PACCT_TRACED_EVENT_COUNT];
+	unsigned int n = b->nr++;
 	u64 ts_delta_ns;
-	u64 wall_ts_delta_ns;
+
+	// Process entries are read here, their hooks only record the runtime
+	if (e->per_process && READ_ONCE(e->ready))
+		pacct_read_process_counts(e);
 
 	// Atomically read and reset the diff_counts and delta_timestamp_acc for this
 	// task. We can get a slightly stale value here, but that's acceptable for
@@ -145,30 +289,63 @@ static __inline__ void pacct_estimate_traced_task_energy(struct traced_task *e)
 		diff_count[i] = atomic64_xchg(&e->diff_counts[i], 0);
 	}
 	ts_delta_ns = atomic64_xchg(&e->delta_exec_runtime_acc, 0);
-	wall_ts_delta_ns = atomic64_xchg(&e->delta_timestamp_acc, 0);
+	b->wall_ns[n] = atomic64_xchg(&e->delta_timestamp_acc, 0);
+	b->runtime_ns[n] = ts_delta_ns;
+	b->task[n] = e;
 	e->total_exec_runtime_acc += ts_delta_ns;
 
-	// Calculate energy estimation based on diff_counts and coefficients
-	s64 acc = 0;
+	// Fill in the events of the subsets that weren't on the PMU, and give
+	// the PMU to the next subset for the coming pass
+	pacct_pmu_scale_diffs(e, diff_count, ts_delta_ns);
+	// The events of a retired task are not rotated anymore
+	if (!READ_ONCE(e->retiring))
+		pacct_pmu_rotate(e);
+
+	// Events without a counter don't contribute to the model
 	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
-		u64 diff = READ_ONCE(diff_count[i]);
-		if (e->event[i] && !IS_ERR(e->event[i]))
-			acc += diff * tracked_events[i].koeff;
-
-		// print debug info about this event
-		// pr_info("PID %d, Event %d: diff=%llu, coeff=%lld, partial_energy=%lld\n",
-		// 	e->pid, i, diff, tracked_events[i].koeff,
-		// 	(__int128)diff * tracked_events[i].koeff);
+		if (e->event[i] && !IS_ERR(e->event[i])) {
+			b->diff[i][n] = diff_count[i];
+			sums[i] += diff_count[i];
+		} else {
+			b->diff[i][n] = 0;
+		}
+	}
+}
+
+// energy = sum of count * koeff for every task of the batch, computed modulo
+// 2^64 like the vector kernel in estimate_avx2.c so that both agree exactly
+static void pacct_estimate_batch_scalar(struct pacct_estimate_batch *b,
+					const s64 *koeff)
+{
+	for (unsigned int n = 0; n < b->nr; n++) {
+		u64 acc = 0;
+
+		for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++)
+			acc += b->diff[i][n] * (u64)koeff[i];
+		b->energy[n] = (s64)acc;
 	}
+}
 
+// Turn the energy of a task over the pass into its energy and power figures.
+// Returns the energy charged in uJ.
+static u64 pacct_estimate_finish(struct traced_task *e, s64 acc,
+				 u64 ts_delta_ns, u64 wall_ts_delta_ns)
+{
 	// We might get some negative energy estimation due to noise, but we can just
 	// treat it as zero in that case since negative energy doesn't make sense.
 	if (acc < 0) {
-		pr_info("Encountered negative energy estimation.");
+		atomic64_inc(&pacct_negative_estimates);
 		acc = 0;
 	}
 
+	// Redistribute the part of the package power the model doesn't explain.
+	// acc is not negative anymore, so the fixed point scaling is a shift.
+	u32 scale = pacct_residual_scale();
+	if (scale != PACCT_RESIDUAL_SCALE_ONE)
+		acc = (u64)acc * scale / PACCT_RESIDUAL_SCALE_ONE;
+
 	atomic64_add(acc, &e->energy); // uJ
+	pacct_history_record(e, acc, ts_delta_ns);
 
 	// Calculate power estimation based on energy and time delta
 	u64 energy = atomic64_read(&e->energy);
@@ -186,34 +363,21 @@ static __inline__ void pacct_estimate_traced_task_energy(struct traced_task *e)
 
 	// Calculate power instance based on energy delta and execution runtime delta
 	s64 dE_uJ = acc;
-	if (dE_uJ < 0)
-		dE_uJ = 0;
-
-	u64 dt_us = ts_delta_ns / 1000;
-	if (dt_us == 0)
-		dt_us = 1;
-	u64 power_i = div64_u64((u64)dE_uJ * 1000, dt_us);
-	u64 old = atomic64_read(&e->power_i);
-	// smoothing to reduce noise 75% old value + 25% new value
-	u64 smoothed = (old * 3 + power_i) >> 2;
-
-	// We can get some 0 energy delta due to estimation noise
-	if (dE_uJ != 0) {
-		atomic64_set(&e->power_i, smoothed);
-	}
-
-	// Calculate power based on wall clock time delta
-	dt_us = wall_ts_delta_ns / 1000;
-	if (dt_us == 0)
-		dt_us = 1;
-	u64 power_w = div64_u64((u64)dE_uJ * 1000, dt_us);
-	old = atomic64_read(&e->power_w);
-	// smoothing to reduce noise 75% old value + 25% new value
-	smoothed = (old * 3 + power_w) >> 2;
 
-	// We can get some 0 energy delta due to estimation noise
+	// Nothing to smooth in, the power figures only move with the energy
 	if (dE_uJ != 0) {
-		atomic64_set(&e->power_w, smoothed);
+		u64 dt_us = max_t(u64, ts_delta_ns / 1000, 1);
+		u64 power_i = div64_u64((u64)dE_uJ * 1000, dt_us);
+		u64 old = atomic64_read(&e->power_i);
+
+		// smoothing to reduce noise 75% old value + 25% new value
+		atomic64_set(&e->power_i, (old * 3 + power_i) >> 2);
+
+		// Calculate power based on wall clock time delta
+		dt_us = max_t(u64, wall_ts_delta_ns / 1000, 1);
+		u64 power_w = div64_u64((u64)dE_uJ * 1000, dt_us);
+		old = atomic64_read(&e->power_w);
+		atomic64_set(&e->power_w, (old * 3 + power_w) >> 2);
 	}
 
 	// 100W threshold for high power task - this can help us identify any
@@ -223,94 +387,410 @@ static __inline__ void pacct_estimate_traced_task_energy(struct traced_task *e)
 	// 	pr_warn("[!!!!!]High power task: PID %d, energy acc=%lld, energy=%llu uJ, total_exec_runtime_us=%llu, power=%llu mW\n",
 	// 		e->pid, (s64)(acc >> 32), energy, total_exec_runtime_us,
 	// 		power);
-	// 	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++) {
-	// 		pr_warn("[!!!!!]Event %d: diff=%llu, coeff=%lld\n", i,
-	// 			diff_count[i], tracked_events[i].koeff);
-	// 	}
 	// }
+
+	trace_pacct_task_energy(e, acc, ts_delta_ns);
+	if (READ_ONCE(e->self))
+		pacct_self_update(e);
+
+	return acc;
 }
 
-static void pacct_energy_estimate_workfn(struct work_struct *work)
+// Publish the totals of the pass that has just ended, and start the next one
+static void pacct_publish_power_snapshot(void)
 {
-	struct delayed_work *dwork =
-		container_of(work, struct delayed_work, work);
+	u64 now = ktime_get_ns();
 
-	struct traced_task *e, *n;
+	write_seqlock(&power_snapshot_lock);
+	pass_totals.energy_uJ = power_snapshot.energy_uJ + pass_totals.delta_uJ;
+	pass_totals.period_ns = power_snapshot.ts_ns ?
+					now - power_snapshot.ts_ns : 0;
+	pass_totals.ts_ns = now;
+	power_snapshot = pass_totals;
+	write_sequnlock(&power_snapshot_lock);
 
-	spin_lock(&traced_tasks_lock);
-	list_for_each_entry_safe(e, n, &traced_tasks, list) {
-		kref_get(&e->ref_count);
+	memset(&pass_totals, 0, sizeof(pass_totals));
+}
 
-		if (!READ_ONCE(e->ready) || READ_ONCE(e->retiring)) {
-			kref_put(&e->ref_count, release_traced_task);
-			continue;
-		}
+// Consistent copy of the totals of the last estimator pass
+void pacct_power_snapshot(struct pacct_power_snapshot *out)
+{
+	unsigned int seq;
 
-		spin_unlock(&traced_tasks_lock);
+	do {
+		seq = read_seqbegin(&power_snapshot_lock);
+		*out = power_snapshot;
+	} while (read_seqretry(&power_snapshot_lock, seq));
+}
 
-		pacct_estimate_traced_task_energy(e);
+int pacct_power_show(struct seq_file *m, void *v)
+{
+	struct pacct_power_snapshot s;
+
+	pacct_power_snapshot(&s);
+	seq_printf(m, "ts_ns %llu\n", s.ts_ns);
+	seq_printf(m, "period_ns %llu\n", s.period_ns);
+	seq_printf(m, "tasks %u\n", s.tasks);
+	seq_printf(m, "active %u\n", s.active);
+	seq_printf(m, "energy_uJ %llu\n", s.energy_uJ);
+	seq_printf(m, "delta_uJ %llu\n", s.delta_uJ);
+	seq_printf(m, "power_w_mW %llu\n", s.power_w_mW);
+	seq_printf(m, "power_i_mW %llu\n", s.power_i_mW);
+	return 0;
+}
 
-		kref_put(&e->ref_count, release_traced_task);
+// Estimate the energy of the gathered tasks via the model and calculate their
+// power. Returns how many of them have run since the last estimation.
+static unsigned int pacct_estimate_batch(struct pacct_estimate_batch *b)
+{
+	s64 koeff[PACCT_TRACED_EVENT_COUNT];
+	unsigned int active = 0;
+
+	// One snapshot of the coefficients for the whole batch
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++)
+		koeff[i] = READ_ONCE(pacct_koeff[i]);
+
+	if (READ_ONCE(estimate_simd) && boot_cpu_has(X86_FEATURE_AVX2) &&
+	    boot_cpu_has(X86_FEATURE_OSXSAVE)) {
+		kernel_fpu_begin();
+		pacct_estimate_batch_avx2(b, koeff);
+		kernel_fpu_end();
+	} else {
+		pacct_estimate_batch_scalar(b, koeff);
+	}
+
+	for (unsigned int n = 0; n < b->nr; n++) {
+		struct traced_task *e = b->task[n];
 
-		// pr_info("Estimated energy for PID %d: %llu\n", e->pid,
-		// 	atomic64_read(&e->energy));
+		u64 delta_uJ = pacct_estimate_finish(e, b->energy[n],
+						     b->runtime_ns[n],
+						     b->wall_ns[n]);
 
-		spin_lock(&traced_tasks_lock);
+		if (b->runtime_ns[n])
+			active++;
+		pacct_top_offer(e);
+		pacct_budget_account(e, delta_uJ);
+
+		// Fold the task into the totals of the pass
+		pass_totals.delta_uJ += delta_uJ;
+		pass_totals.power_w_mW += atomic64_read(&e->power_w);
+		pass_totals.power_i_mW += atomic64_read(&e->power_i);
 	}
-	spin_unlock(&traced_tasks_lock);
+	pass_totals.tasks += b->nr;
+	pass_totals.active += active;
+
+	b->nr = 0;
+	return active;
+}
+
+// Last estimation of a retired entry, from the retire work with the walk lock
+// held. Its energy is added to the totals of the next pass, but the task
+// doesn't join the top index nor the model sums anymore.
+static void pacct_estimate_retired(struct traced_task *e)
+{
+	u64 sums[PACCT_TRACED_EVENT_COUNT] = { 0 };
+	s64 koeff[PACCT_TRACED_EVENT_COUNT];
+	struct pacct_estimate_batch *b = &retire_batch;
+
+	for (int i = 0; i < PACCT_TRACED_EVENT_COUNT; i++)
+		koeff[i] = READ_ONCE(pacct_koeff[i]);
+
+	pacct_estimate_gather(b, e, sums);
+	pacct_estimate_batch_scalar(b, koeff);
+	atomic64_add(pacct_estimate_finish(e, b->energy[0], b->runtime_ns[0],
+					   b->wall_ns[0]),
+		     &retired_uJ);
+	b->nr = 0;
+}
+
+// Tighten the estimator period under load and stretch it while the system is
+// (nearly) idle. The period is doubled when no task has run at all, and grows
+// more slowly while only a few tasks are active.
+static void pacct_adapt_estimate_period(unsigned int active)
+{
+	unsigned int min_ms = max(READ_ONCE(estimate_period_min_ms), 1U);
+	unsigned int max_ms = max(READ_ONCE(estimate_period_max_ms), min_ms);
+	unsigned int period = READ_ONCE(estimate_period_ms);
+
+	if (active >= READ_ONCE(estimate_busy_tasks))
+		period = min_ms;
+	else if (active == 0)
+		period *= 2;
+	else
+		period += period / 4;
+
+	WRITE_ONCE(estimate_period_ms, clamp(period, min_ms, max_ms));
+}
+
+// The gather period stretches by the same factor as the estimator period
+static unsigned long pacct_gather_period_jiffies(void)
+{
+	unsigned int min_ms = max(READ_ONCE(estimate_period_min_ms), 1U);
+	u64 period = div_u64((u64)TOTAL_POWER_GATHER_PERIOD_MS *
+				     READ_ONCE(estimate_period_ms),
+			     min_ms);
+
+	return msecs_to_jiffies(max_t(u64, period,
+				      TOTAL_POWER_GATHER_PERIOD_MS));
+}
+
+static void pacct_energy_estimate_workfn(struct work_struct *work)
+{
+	struct delayed_work *dwork =
+		container_of(work, struct delayed_work, work);
+
+	struct traced_task *e;
+	u64 sums[PACCT_TRACED_EVENT_COUNT] = { 0 };
+	unsigned int active = 0;
+
+	pacct_hk_check(PACCT_WORK_ESTIMATE);
+	pacct_top_begin();
+	pacct_budget_begin();
+
+	// Reading the inherited counters and rotating the PMU subsets may sleep,
+	// so the walk can't be in an RCU read-side section. It holds off the free
+	// work instead: an entry retired meanwhile stays allocated, and its next
+	// pointer still leads back to the list.
+	mutex_lock(&traced_tasks_walk_lock);
+	list_for_each_entry_rcu(e, &traced_tasks, list,
+				lockdep_is_held(&traced_tasks_walk_lock)) {
+		if (!READ_ONCE(e->ready) || READ_ONCE(e->retiring))
+			continue;
+
+		// The entries of the batch stay allocated as long as the walk
+		// lock is held
+		pacct_estimate_gather(&estimate_batch, e, sums);
+		if (estimate_batch.nr == PACCT_ESTIMATE_BATCH)
+			active += pacct_estimate_batch(&estimate_batch);
+
+		cond_resched();
+	}
+	if (estimate_batch.nr)
+		active += pacct_estimate_batch(&estimate_batch);
+	mutex_unlock(&traced_tasks_walk_lock);
+
+	pacct_top_publish();
+	pass_totals.delta_uJ += atomic64_xchg(&retired_uJ, 0);
+	pacct_budget_end();
+	pacct_cpus_account(pass_totals.delta_uJ);
+	pacct_publish_power_snapshot();
+	pacct_model_account(sums);
+	pacct_adapt_estimate_period(active);
+	pacct_netlink_flush();
 
 	if (atomic_read(&estimator_enabled))
-		schedule_delayed_work(
-			dwork, msecs_to_jiffies(ENERGY_ESTIMATE_PERIOD_MS));
+		queue_delayed_work_on(pacct_hk_cpu(), pacct_wq, dwork,
+				      msecs_to_jiffies(READ_ONCE(estimate_period_ms)));
 }
 
-static DECLARE_DELAYED_WORK(pacct_energy_estimate_work,
-			    pacct_energy_estimate_workfn);
+static DECLARE_DEFERRABLE_WORK(pacct_energy_estimate_work,
+			       pacct_energy_estimate_workfn);
+
+// A range of the snapshot attached by one per-CPU worker
+struct pacct_scan_chunk {
+	struct work_struct work;
+	unsigned int start;
+	unsigned int end;
+};
+
+// Extra slots for processes forked between counting and filling the snapshot.
+// Anything we miss here is picked up by the fork hook anyway.
+#define PACCT_SCAN_SLACK 256
+
+static struct pacct_scan_slot *scan_slots;
+static struct pacct_scan_chunk *scan_chunks;
+static atomic_t scan_chunks_left = ATOMIC_INIT(0);
+static bool scan_started;
+static u64 scan_start_ns;
+static DECLARE_COMPLETION(scan_done);
+
+// Whether an existing task is attached by the scan or a filter rewrite. Only
+// the leaders are, as the fork hook picks up the threads created afterwards.
+// Called under RCU.
+static bool pacct_scan_wanted(struct task_struct *t)
+{
+	if (t->flags & PF_KTHREAD)
+		return false;
+	return pacct_filter_match(t) && pacct_task_has_entry(t);
+}
 
-// Add all existing processes to our traced_tasks list to be initialized later
-static void pacct_scan_tasks_workfn(struct work_struct *work)
+// Snapshot the processes to attach. The task list is walked under RCU only,
+// the caller creates the entries from the slots and frees them with kvfree().
+// Returns the number of slots filled, or -ENOMEM.
+int pacct_scan_snapshot(struct pacct_scan_slot **slots)
 {
 	struct task_struct *task;
+	unsigned int nr = 0, cap = 0;
 
-	// Iterate over all existing tasks and add them to the traced_tasks list if
-	// they are not kernel threads.
-	for_each_process(task) {
-		struct task_struct *ts = task;
+	rcu_read_lock();
+	for_each_process(task)
+		cap++;
+	rcu_read_unlock();
+	cap += PACCT_SCAN_SLACK;
 
-		get_task_struct(ts);
+	*slots = kvmalloc_array(cap, sizeof(**slots), GFP_KERNEL);
+	if (!*slots)
+		return -ENOMEM;
 
-		if (ts->flags & PF_KTHREAD) {
-			put_task_struct(ts);
+	rcu_read_lock();
+	for_each_process(task) {
+		if (!pacct_scan_wanted(task))
 			continue;
+		if (nr == cap)
+			break;
+		(*slots)[nr].pid = task->pid;
+		strscpy((*slots)[nr].comm, task->comm, TASK_COMM_LEN);
+		nr++;
+	}
+	rcu_read_unlock();
+
+	return nr;
+}
+
+// Create the entries of one snapshot range and set up their counters right
+// away, so that they are accounted as soon as the worker is done.
+static void pacct_scan_chunk_workfn(struct work_struct *work)
+{
+	struct pacct_scan_chunk *chunk =
+		container_of(work, struct pacct_scan_chunk, work);
+
+	pacct_hk_check(PACCT_WORK_SCAN);
+	for (unsigned int i = chunk->start; i < chunk->end; i++) {
+		struct pacct_scan_slot *slot = &scan_slots[i];
+		struct traced_task *e;
+
+		// Pinned for the setup of the counters, which sleeps
+		rcu_read_lock();
+		e = get_or_create_traced_task(slot->pid, slot->pid, slot->comm,
+					      true);
+		if (e)
+			kref_get(&e->ref_count);
+		rcu_read_unlock();
+		if (!e) {
+			pr_err("Failed to get or create traced task for PID %d\n",
+			       slot->pid);
+			atomic_inc(&scan_stats.failed);
+			goto next;
 		}
 
-		{
-			struct traced_task *e = get_or_create_traced_task(
-				ts->pid, ts->comm, true);
-			if (!e) {
-				pr_err("Failed to get or create traced task for PID %d\n",
-				       ts->pid);
-				put_task_struct(ts);
-				continue;
+		// The setup work may race with us for entries created by the fork
+		// hook, only one of us sets up the counters.
+		if (claim_traced_task_setup(e)) {
+			bool ok = setup_traced_task_counters(e) == 0;
+
+			WRITE_ONCE(e->ready, ok);
+			if (!ok) {
+				atomic_inc(&scan_stats.failed);
+				pacct_retire_if_exited(e);
 			}
+		}
 
-			// pr_info("Initially tracing existing process: PID %d, COMM %s\n",
-			// 	ts->pid, ts->comm);
+		kref_put(&e->ref_count, release_traced_task);
+next:
+		atomic_inc(&scan_stats.done);
+		cond_resched();
+	}
 
-			kref_put(&e->ref_count, release_traced_task);
-		}
+	if (atomic_dec_and_test(&scan_chunks_left)) {
+		WRITE_ONCE(scan_stats.elapsed_ns, ktime_get_ns() - scan_start_ns);
+		pr_info("Attached %d processes in %llu us\n",
+			atomic_read(&scan_stats.done),
+			READ_ONCE(scan_stats.elapsed_ns) / 1000);
+
+		kvfree(scan_slots);
+		scan_slots = NULL;
+		// The chunk array can be freed from within one of its work items,
+		// the workqueue doesn't touch a work item after its function returns
+		kfree(scan_chunks);
+		scan_chunks = NULL;
+
+		complete_all(&scan_done);
 
-		put_task_struct(ts);
+		// Pick up the tasks the fork hook has queued in the meantime
+		queue_pacct_setup_work();
 	}
+}
+
+// Snapshot all existing processes and attach them in parallel on all online
+// CPUs. The snapshot is taken under RCU only, creating the entries and perf
+// counters (which may sleep) is done by the per-CPU workers.
+static void pacct_scan_tasks_workfn(struct work_struct *work)
+{
+	unsigned int nr, nr_chunks, per_chunk, cpu, c = 0;
+	int ret;
+
+	pacct_hk_check(PACCT_WORK_SCAN);
+	scan_start_ns = ktime_get_ns();
 
-	queue_pacct_setup_work();
+	ret = pacct_scan_snapshot(&scan_slots);
+	if (ret < 0) {
+		pr_err("Failed to allocate the task snapshot\n");
+		WRITE_ONCE(scan_stats.elapsed_ns, ktime_get_ns() - scan_start_ns);
+		complete_all(&scan_done);
+		return;
+	}
+	nr = ret;
+
+	atomic_set(&scan_stats.total, nr);
+
+	// One chunk per housekeeping CPU
+	nr_chunks = min_t(unsigned int, pacct_hk_nr_cpus(), nr);
+	if (nr_chunks == 0)
+		goto out_empty;
+
+	scan_chunks = kcalloc(nr_chunks, sizeof(*scan_chunks), GFP_KERNEL);
+	if (!scan_chunks) {
+		// Fall back to attaching everything from this worker
+		struct pacct_scan_chunk chunk = { .start = 0, .end = nr };
+
+		pr_warn("Failed to allocate scan chunks, attaching serially\n");
+		atomic_set(&scan_chunks_left, 1);
+		pacct_scan_chunk_workfn(&chunk.work);
+		return;
+	}
+
+	per_chunk = DIV_ROUND_UP(nr, nr_chunks);
+	atomic_set(&scan_chunks_left, nr_chunks);
+	for_each_online_cpu(cpu) {
+		struct pacct_scan_chunk *chunk = &scan_chunks[c];
+
+		if (c == nr_chunks)
+			break;
+		if (!pacct_hk_allowed(cpu))
+			continue;
+
+		chunk->start = c * per_chunk;
+		chunk->end = min(nr, chunk->start + per_chunk);
+		INIT_WORK(&chunk->work, pacct_scan_chunk_workfn);
+		queue_work_on(cpu, pacct_wq, &chunk->work);
+		c++;
+	}
+
+	// CPUs may have gone offline since we sized the chunks, queue the
+	// remaining ones on whichever housekeeping CPU is left.
+	for (; c < nr_chunks; c++) {
+		struct pacct_scan_chunk *chunk = &scan_chunks[c];
+
+		chunk->start = c * per_chunk;
+		chunk->end = min(nr, chunk->start + per_chunk);
+		INIT_WORK(&chunk->work, pacct_scan_chunk_workfn);
+		queue_work_on(pacct_hk_cpu(), pacct_wq, &chunk->work);
+	}
+	return;
+
+out_empty:
+	kvfree(scan_slots);
+	scan_slots = NULL;
+	WRITE_ONCE(scan_stats.elapsed_ns, ktime_get_ns() - scan_start_ns);
+	complete_all(&scan_done);
 }
 
-static DECLARE_DELAYED_WORK(pacct_scan_tasks_work, pacct_scan_tasks_workfn);
+static DECLARE_WORK(pacct_scan_tasks_work, pacct_scan_tasks_workfn);
 
 void queue_pacct_scan_tasks(void)
 {
-	schedule_delayed_work(&pacct_scan_tasks_work, msecs_to_jiffies(100));
+	scan_started = true;
+	queue_work_on(pacct_hk_cpu(), pacct_wq, &pacct_scan_tasks_work);
 }
 
 //Calculate the power measured via rapl
@@ -320,7 +800,7 @@ static u64 sample_pkg_power(void)
 	u64 now = ktime_get_ns();
 
 	if (rapl_eu_shift == 0) {
-		int ret = rapl_read_eu_shift_on_cpu(0);
+		int ret = rapl_read_eu_shift_on_cpu(pacct_hk_msr_cpu());
 		if (ret) {
 			pr_err("Failed to read RAPL energy unit shift: %d\n",
 			       ret);
@@ -329,18 +809,22 @@ static u64 sample_pkg_power(void)
 		pr_info("RAPL energy unit shift: %u\n", rapl_eu_shift);
 	}
 
+	// Any CPU of the package reads its counter, pick a housekeeping one
+	int cpu = pacct_hk_msr_cpu();
 	u64 raw = 0;
-	int ret = rapl_read_pkg_energy_uj_on_cpu(0, &raw);
+	int ret = rapl_read_pkg_energy_uj_on_cpu(cpu, &raw);
 	if (ret) {
-		pr_err("Failed to read RAPL energy on CPU 0: %d\n", ret);
+		pr_err("Failed to read RAPL energy on CPU %d: %d\n", cpu, ret);
 		return 0;
 	}
 
-	pr_info("RAPL raw energy: %llu (uJ)\n", raw);
+	if (static_branch_unlikely(&pacct_recording))
+		pacct_record_rapl(now, raw);
 
 	if (last_pkg_raw == 0) {
 		last_pkg_raw = raw;
 		last_ns = now;
+		trace_pacct_rapl_sample(raw, 0, 0);
 		return 0;
 	}
 
@@ -355,6 +839,7 @@ static u64 sample_pkg_power(void)
 
 	// Power in mW = energy in uJ / time in ms = energy in uJ / time in ns * 1e6
 	u64 power = div64_u64(d_raw * 1000000, dt_ns);
+	trace_pacct_rapl_sample(raw, dt_ns, power);
 	return power;
 }
 
@@ -362,65 +847,32 @@ static void pacct_gather_total_power_workfn(struct work_struct *work)
 {
 	struct delayed_work *dwork =
 		container_of(work, struct delayed_work, work);
-	struct traced_task *e;
-	struct traced_task *n;
+	struct pacct_power_snapshot snap;
 
-	WRITE_ONCE(total_power, 0);
+	pacct_hk_check(PACCT_WORK_GATHER);
 
-	spin_lock(&traced_tasks_lock);
-	list_for_each_entry_safe(e, n, &traced_tasks, list) {
-		kref_get(&e->ref_count);
-
-		if (!READ_ONCE(e->ready)) {
-			kref_put(&e->ref_count, release_traced_task);
-			continue;
-		}
-
-		spin_unlock(&traced_tasks_lock);
-
-		u64 pw = atomic64_read(&e->power_w);
-		total_power += pw;
-
-		// struct task_struct *ts = get_task_by_pid(e->pid);
-		// if (ts) {
-		// 	int cpu = task_cpu(ts);
-
-		// 	// only print tasks running on P-core
-		// 	if (cpu >= 0 && cpu < 12)
-		// 		pr_info("PID %d (%s): energy=%llu uJ, power=%llu mW, "
-		// 			"power_i=%llu mW, power_w=%llu mW record_count=%d, "
-		// 			"cpu=%d\n",
-		// 			e->pid, e->comm,
-		// 			atomic64_read(&e->energy),
-		// 			atomic64_read(&e->power_a),
-		// 			atomic64_read(&e->power_i),
-		// 			atomic64_read(&e->power_w),
-		// 			atomic_read(&e->record_count),
-		// 			task_cpu(ts));
-
-		// 	put_task_struct(ts);
-		// }
-
-		kref_put(&e->ref_count, release_traced_task);
-		spin_lock(&traced_tasks_lock);
-	}
-	spin_unlock(&traced_tasks_lock);
+	// The estimator keeps the sum up to date, no need to walk the tasks
+	pacct_power_snapshot(&snap);
+	WRITE_ONCE(total_power, snap.power_w_mW);
 
 	u64 pkg_power = sample_pkg_power(); //measured using rapl
-	pr_info("Power: avg power: %llu mW, pkg power: %llu mW\n", total_power,
-		pkg_power);
+
+	// Reconcile the estimate with RAPL and recalibrate the model against it
+	s64 explained = pacct_update_power_breakdown(snap.power_w_mW, pkg_power);
+	trace_pacct_power(snap.power_w_mW, pkg_power, explained);
+	pacct_model_update(explained);
 
 	// simple power capping control based on the sampled package power
 	if (enable_power_cap)
 		pacct_powercap_control_step(pkg_power);
 
 	if (atomic_read(&estimator_enabled))
-		schedule_delayed_work(
-			dwork, msecs_to_jiffies(TOTAL_POWER_GATHER_PERIOD_MS));
+		queue_delayed_work_on(pacct_hk_cpu(), pacct_wq, dwork,
+				      pacct_gather_period_jiffies());
 }
 
-static DECLARE_DELAYED_WORK(pacct_gather_total_power_work,
-			    pacct_gather_total_power_workfn);
+static DECLARE_DEFERRABLE_WORK(pacct_gather_total_power_work,
+			       pacct_gather_total_power_workfn);
 
 void pacct_start_energy_estimator(void)
 {
@@ -428,11 +880,14 @@ void pacct_start_energy_estimator(void)
 			1)) //Ensure estimator is only activated once
 		return;
 
-	schedule_delayed_work(&pacct_energy_estimate_work,
-			      msecs_to_jiffies(ENERGY_ESTIMATE_PERIOD_MS));
+	WRITE_ONCE(estimate_period_ms, estimate_period_min_ms);
+	queue_delayed_work_on(pacct_hk_cpu(), pacct_wq,
+			      &pacct_energy_estimate_work,
+			      msecs_to_jiffies(estimate_period_ms));
 	// Sum power of all processes and compare to rapl printing to log
-	schedule_delayed_work(&pacct_gather_total_power_work,
-			      msecs_to_jiffies(TOTAL_POWER_GATHER_PERIOD_MS));
+	queue_delayed_work_on(pacct_hk_cpu(), pacct_wq,
+			      &pacct_gather_total_power_work,
+			      pacct_gather_period_jiffies());
 }
 
 void pacct_stop_energy_estimator(void)
@@ -440,4 +895,31 @@ void pacct_stop_energy_estimator(void)
 	atomic_set(&estimator_enabled, 0);
 	cancel_delayed_work_sync(&pacct_energy_estimate_work);
 	cancel_delayed_work_sync(&pacct_gather_total_power_work);
-}
\ No newline at end of file
+}
+
+// Release every traced task left at unload. All trace hooks must have been
+// unregistered and the estimator stopped before calling this.
+void pacct_drain_traced_tasks(void)
+{
+	struct traced_task *entry, *tmp;
+
+	// The scan can't be cancelled halfway, its workers own the snapshot
+	if (scan_started)
+		wait_for_completion(&scan_done);
+	cancel_work_sync(&pacct_setup_work);
+
+	// Move all currently traced tasks to the retiring list for cleanup
+	spin_lock(&traced_tasks_lock);
+	list_for_each_entry_safe(entry, tmp, &traced_tasks, list) {
+		list_del_rcu(&entry->list);
+		hash_del_rcu(&entry->hnode);
+		clear_bit(entry->pid, traced_pids);
+		list_add_tail(&entry->retire_node, &retiring_traced_tasks);
+		atomic_inc(&reclaim_stats.pending);
+	}
+	spin_unlock(&traced_tasks_lock);
+
+	cancel_delayed_work_sync(&pacct_retire_work);
+	pacct_retire_workfn(NULL);
+	flush_released_traced_tasks();
+}